@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Acknowledged delivery. A client asking for acknowledgements numbers
+ * the batches of a session. Per session, identified by the client's
+ * address, port and session number, the highest sequence number applied
+ * and a bitmap of the ACK_WINDOW numbers up to it are kept, as in an
+ * anti-replay window: a batch in the window is applied once, a copy of
+ * an applied batch is only acknowledged again. Clients keep at most
+ * ACK_WINDOW batches unacknowledged, so the window covers all of them.
+ *
+ * Sessions live in a fixed hash table. A new session takes the least
+ * recently used slot of its probe sequence, so a busy daemon forgets
+ * the oldest sessions first.
+ */
+
+#include "pftabled.h"
+
+#include <string.h>
+
+#define ACK_SESSIONS	4096	/* Power of two */
+#define ACK_PROBE	8	/* Slots tried per session */
+
+struct session {
+	struct in_addr	addr;
+	uint16_t	port;
+	uint16_t	id;
+	uint16_t	top;		/* highest sequence number applied */
+	uint32_t	applied;	/* bit i set if top - i was applied */
+	time_t		used;		/* 0 if free */
+};
+
+static struct session sessions[ACK_SESSIONS];
+
+static struct session *
+lookup(struct sockaddr_in *from, struct ackreq *a, time_t now)
+{
+	struct session *s, *lru = NULL;
+	uint32_t h;
+	int i;
+
+	h = (from->sin_addr.s_addr ^ (uint32_t)from->sin_port << 16 ^
+	    a->session) * 2654435761U >> 20;
+
+	for (i = 0; i < ACK_PROBE; i++) {
+		s = &sessions[(h + i) & (ACK_SESSIONS - 1)];
+		if (s->used && s->addr.s_addr == from->sin_addr.s_addr &&
+		    s->port == from->sin_port && s->id == a->session) {
+			s->used = now;
+			return (s);
+		}
+		if (lru == NULL || s->used < lru->used)
+			lru = s;
+	}
+
+	lru->addr = from->sin_addr;
+	lru->port = from->sin_port;
+	lru->id = a->session;
+	lru->top = a->seq;
+	lru->applied = 0;
+	lru->used = now;
+
+	return (lru);
+}
+
+/* Returns 1 if the batch of a was applied before */
+int
+ack_seen(struct sockaddr_in *from, struct ackreq *a, time_t now)
+{
+	struct session *s = lookup(from, a, now);
+	int d = (int16_t)(a->seq - s->top);
+
+	if (d > 0)
+		return (0);
+	if (d <= -ACK_WINDOW)
+		return (1);
+
+	return (s->applied >> -d & 1);
+}
+
+/*
+ * Record the batch of a as applied and fill in the signed
+ * acknowledgement of its session.
+ */
+void
+ack_applied(struct conf *c, struct sockaddr_in *from, struct ackreq *a,
+    time_t now, struct pftabled_ack *ack)
+{
+	struct session *s = lookup(from, a, now);
+	int d = (int16_t)(a->seq - s->top);
+
+	if (d > 0) {
+		s->applied = d < ACK_WINDOW ? s->applied << d : 0;
+		s->top = a->seq;
+		d = 0;
+	}
+	if (d > -ACK_WINDOW)
+		s->applied |= 1U << -d;
+
+	memset(ack, 0, sizeof(*ack));
+	ack->version = PFTABLED_ACK_VERSION;
+	ack->mac = a->mac;
+	ack->session = htons(a->session);
+	ack->seq = htons(s->top);
+	ack->applied = htonl(s->applied);
+	if (c->use_key)
+		mac_sign(a->mac, c->key, ack, sizeof(*ack), ack->digest);
+}
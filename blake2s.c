@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * BLAKE2s as specified in RFC 7693, one-shot only. With a key it is a
+ * MAC by itself and needs a single compression more than the message,
+ * against four for HMAC-SHA1 on short messages.
+ *
+ * Test vector (RFC 7693, Appendix B)
+ * "abc", no key, 32 bytes
+ *   508C5E8C 327C14E2 E1A72BA3 4EEB452F 37458B20 9ED63A29 4D999B4C 86675982
+ */
+
+#include "pftabled.h"
+
+#include <string.h>
+
+#define BLAKE2S_BLOCK	64
+
+#define ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+#define G(a, b, c, d, x, y) do {				\
+	v[a] += v[b] + (x); v[d] = ROTR(v[d] ^ v[a], 16);	\
+	v[c] += v[d];       v[b] = ROTR(v[b] ^ v[c], 12);	\
+	v[a] += v[b] + (y); v[d] = ROTR(v[d] ^ v[a], 8);	\
+	v[c] += v[d];       v[b] = ROTR(v[b] ^ v[c], 7);	\
+} while (0)
+
+static const uint32_t iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const uint8_t sigma[10][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 14, 10, 4, 8, 9, 15, 13, 6, 1, 12, 0, 2, 11, 7, 5, 3 },
+	{ 11, 8, 12, 0, 5, 2, 15, 13, 10, 14, 3, 6, 7, 1, 9, 4 },
+	{ 7, 9, 3, 1, 13, 12, 11, 14, 2, 6, 5, 10, 4, 0, 15, 8 },
+	{ 9, 0, 5, 7, 2, 4, 10, 15, 14, 1, 11, 12, 6, 8, 3, 13 },
+	{ 2, 12, 6, 10, 0, 11, 8, 3, 4, 13, 7, 5, 15, 14, 1, 9 },
+	{ 12, 5, 1, 15, 14, 13, 4, 10, 0, 7, 6, 3, 9, 2, 8, 11 },
+	{ 13, 11, 7, 14, 12, 1, 3, 9, 5, 0, 15, 4, 8, 6, 2, 10 },
+	{ 6, 15, 14, 9, 11, 3, 0, 8, 12, 2, 13, 7, 1, 4, 10, 5 },
+	{ 10, 2, 8, 4, 7, 6, 1, 5, 15, 11, 9, 14, 3, 12, 13, 0 }
+};
+
+static void
+compress(uint32_t h[8], const uint8_t *block, uint64_t t, int last)
+{
+	uint32_t v[16], m[16];
+	const uint8_t *s;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		m[i] = (uint32_t)block[4 * i] |
+		    (uint32_t)block[4 * i + 1] << 8 |
+		    (uint32_t)block[4 * i + 2] << 16 |
+		    (uint32_t)block[4 * i + 3] << 24;
+
+	for (i = 0; i < 8; i++) {
+		v[i] = h[i];
+		v[i + 8] = iv[i];
+	}
+	v[12] ^= (uint32_t)t;
+	v[13] ^= (uint32_t)(t >> 32);
+	if (last)
+		v[14] = ~v[14];
+
+	for (i = 0; i < 10; i++) {
+		s = sigma[i];
+		G(0, 4,  8, 12, m[s[0]], m[s[1]]);
+		G(1, 5,  9, 13, m[s[2]], m[s[3]]);
+		G(2, 6, 10, 14, m[s[4]], m[s[5]]);
+		G(3, 7, 11, 15, m[s[6]], m[s[7]]);
+		G(0, 5, 10, 15, m[s[8]], m[s[9]]);
+		G(1, 6, 11, 12, m[s[10]], m[s[11]]);
+		G(2, 7,  8, 13, m[s[12]], m[s[13]]);
+		G(3, 4,  9, 14, m[s[14]], m[s[15]]);
+	}
+
+	for (i = 0; i < 8; i++)
+		h[i] ^= v[i] ^ v[i + 8];
+}
+
+/*
+ * Hash len bytes at data with a key of keylen bytes, at most 32, into
+ * outlen bytes, at most 32, at out.
+ */
+void
+blake2s(uint8_t *out, size_t outlen, const uint8_t *key, size_t keylen,
+    const void *data, size_t len)
+{
+	uint8_t block[BLAKE2S_BLOCK];
+	const uint8_t *p = data;
+	uint32_t h[8];
+	uint64_t t = 0;
+	size_t i;
+
+	for (i = 0; i < 8; i++)
+		h[i] = iv[i];
+	h[0] ^= 0x01010000 ^ (keylen << 8) ^ outlen;
+
+	if (keylen > 0) {
+		memset(block, 0, sizeof(block));
+		memcpy(block, key, keylen);
+		t = BLAKE2S_BLOCK;
+		compress(h, block, t, len == 0);
+	}
+
+	for (; len > BLAKE2S_BLOCK; p += BLAKE2S_BLOCK, len -= BLAKE2S_BLOCK) {
+		t += BLAKE2S_BLOCK;
+		compress(h, p, t, 0);
+	}
+
+	if (len > 0 || keylen == 0) {
+		memset(block, 0, sizeof(block));
+		memcpy(block, p, len);
+		t += len;
+		compress(h, block, t, 1);
+	}
+
+	for (i = 0; i < outlen; i++)
+		out[i] = h[i / 4] >> (8 * (i % 4));
+}
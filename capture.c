@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Capture files. A capture is a struct capture_hdr followed by one
+ * struct capture_rec and the raw datagram per received packet, all
+ * fields in network byte order.
+ */
+
+#include "pftabled.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* Open path for appending, writing the file header if it is empty */
+FILE *
+capture_open(const char *path)
+{
+	struct capture_hdr hdr;
+	struct stat st;
+	FILE *f;
+
+	if ((f = fopen(path, "a")) == NULL)
+		return (NULL);
+
+	if (fstat(fileno(f), &st) == -1) {
+		fclose(f);
+		return (NULL);
+	}
+
+	if (st.st_size == 0) {
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic = htonl(CAPTURE_MAGIC);
+		hdr.version = htons(CAPTURE_VERSION);
+		if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fflush(f) == EOF) {
+			fclose(f);
+			return (NULL);
+		}
+	}
+
+	return (f);
+}
+
+int
+capture_write(FILE *f, struct timespec *ts, struct sockaddr_in *from,
+    void *buf, int len)
+{
+	struct capture_rec rec;
+
+	rec.sec = htonl((uint32_t)ts->tv_sec);
+	rec.nsec = htonl((uint32_t)ts->tv_nsec);
+	rec.addr = from->sin_addr;
+	rec.port = from->sin_port;
+	rec.len = htons((uint16_t)len);
+
+	if (fwrite(&rec, sizeof(rec), 1, f) != 1 ||
+	    fwrite(buf, len, 1, f) != 1)
+		return (-1);
+
+	return (0);
+}
+
+/* Check the header of a capture file opened for reading */
+int
+capture_check(FILE *f)
+{
+	struct capture_hdr hdr;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    ntohl(hdr.magic) != CAPTURE_MAGIC ||
+	    ntohs(hdr.version) != CAPTURE_VERSION)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Read the next record into rec, converted to host byte order, and up to
+ * size bytes of its datagram into buf. rec->len is set to the number of
+ * bytes stored. Returns 1 for a record, 0 at the end of the file and -1
+ * on errors.
+ */
+int
+capture_read(FILE *f, struct capture_rec *rec, void *buf, size_t size)
+{
+	size_t len;
+
+	if (fread(rec, sizeof(*rec), 1, f) != 1)
+		return (feof(f) ? 0 : -1);
+
+	rec->sec = ntohl(rec->sec);
+	rec->nsec = ntohl(rec->nsec);
+	rec->len = ntohs(rec->len);
+
+	len = rec->len < size ? rec->len : size;
+	if (len > 0 && fread(buf, len, 1, f) != 1)
+		return (-1);
+	if (rec->len > len && fseek(f, rec->len - len, SEEK_CUR) == -1)
+		return (-1);
+	rec->len = len;
+
+	return (1);
+}
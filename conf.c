@@ -0,0 +1,524 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Configuration file handling. The file and the key it names are read
+ * by a parent process which keeps its privileges and stays outside the
+ * chroot. The parsed settings are passed to the chrooted child over a
+ * socket pair, where conf_build() merges them with the command line
+ * into an immutable struct conf.
+ */
+
+#include "pftabled.h"
+
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+void
+conf_init(struct confdata *cd)
+{
+	memset(cd, 0, sizeof(*cd));
+	cd->timeout = -1;
+	cd->idle = -1;
+	cd->macs = -1;
+}
+
+void
+conf_free(struct confdata *cd)
+{
+	free(cd->tables);
+	free(cd->protect);
+	free(cd->ttls);
+	conf_init(cd);
+}
+
+int
+conf_readkey(const char *path, uint8_t *key)
+{
+	int fd, n;
+
+	if ((fd = open(path, O_RDONLY, 0)) == -1)
+		return (-1);
+	n = read(fd, key, SHA1_DIGEST_LENGTH);
+	close(fd);
+
+	return (n == SHA1_DIGEST_LENGTH ? 0 : -1);
+}
+
+int
+conf_addtable(struct confdata *cd, const char *name)
+{
+	void *p;
+
+	if (strlen(name) >= PF_TABLE_NAME_SIZE)
+		return (-1);
+
+	if ((p = realloc(cd->tables, (cd->ntables + 1) *
+	    sizeof(*cd->tables))) == NULL)
+		return (-1);
+	cd->tables = p;
+
+	memset(cd->tables[cd->ntables], 0, PF_TABLE_NAME_SIZE);
+	strncpy(cd->tables[cd->ntables], name, PF_TABLE_NAME_SIZE - 1);
+	cd->ntables++;
+
+	return (0);
+}
+
+/* Add prefix s, an address with an optional /mask, to cd */
+static int
+conf_addprotect(struct confdata *cd, char *s)
+{
+	struct prefix *p;
+	char *slash, *end;
+	long mask = 32;
+
+	if (cd->nprotect == PROTECT_MAX)
+		return (-1);
+
+	if ((slash = strchr(s, '/')) != NULL) {
+		*slash++ = '\0';
+		mask = strtol(slash, &end, 10);
+		if (*slash == '\0' || *end != '\0' || mask < 0 || mask > 32)
+			return (-1);
+	}
+
+	if ((cd->nprotect & (cd->nprotect - 1)) == 0) {
+		if ((p = realloc(cd->protect, (cd->nprotect ?
+		    cd->nprotect * 2 : 1) * sizeof(*p))) == NULL)
+			return (-1);
+		cd->protect = p;
+	}
+
+	p = &cd->protect[cd->nprotect];
+	memset(p, 0, sizeof(*p));
+	if (inet_pton(AF_INET, s, &p->addr) != 1)
+		return (-1);
+	p->mask = mask;
+	cleanmask(&p->addr, p->mask);
+	cd->nprotect++;
+
+	return (0);
+}
+
+/* Parse s, a list of MAC names, into the accepted MACs of cd */
+static int
+conf_macs(struct confdata *cd, char *s)
+{
+	char *name;
+	int id;
+
+	cd->macs = 0;
+	while (*s != '\0') {
+		for (name = s; *s && !isspace((unsigned char)*s); s++)
+			;
+		if (*s != '\0')
+			*s++ = '\0';
+		while (isspace((unsigned char)*s))
+			s++;
+		if ((id = mac_lookup(name)) == -1)
+			return (-1);
+		cd->macs |= 1 << id;
+	}
+
+	return (0);
+}
+
+/* Add lifetimes from s, "table default [maximum]", to cd */
+static int
+conf_addttl(struct confdata *cd, char *s)
+{
+	struct ttlconf *t;
+	char *name, *end;
+	long def, max;
+	void *p;
+
+	if (cd->nttls == TABLE_MAX)
+		return (-1);
+
+	for (name = s; *s && !isspace((unsigned char)*s); s++)
+		;
+	if (*s == '\0')
+		return (-1);
+	*s++ = '\0';
+	while (isspace((unsigned char)*s))
+		s++;
+	if (strlen(name) >= PF_TABLE_NAME_SIZE)
+		return (-1);
+	def = strtol(s, &end, 10);
+	if (end == s || def < 0)
+		return (-1);
+	for (s = end; isspace((unsigned char)*s); s++)
+		;
+	max = def;
+	if (*s != '\0') {
+		max = strtol(s, &end, 10);
+		if (*end != '\0' || max < 0 || (max && def > max))
+			return (-1);
+	}
+
+	if ((p = realloc(cd->ttls, (cd->nttls + 1) *
+	    sizeof(*cd->ttls))) == NULL)
+		return (-1);
+	cd->ttls = p;
+
+	t = &cd->ttls[cd->nttls];
+	memset(t, 0, sizeof(*t));
+	memcpy(t->table, name, strlen(name));
+	t->def = def;
+	t->max = max;
+	cd->nttls++;
+
+	return (0);
+}
+
+/*
+ * Parse configuration file path into cd. Returns -1 and a message in
+ * errbuf on failure.
+ */
+int
+conf_parse(const char *path, struct confdata *cd, char *errbuf, size_t len)
+{
+	FILE *f;
+	char line[1024], *kw, *arg, *p;
+	int lineno = 0;
+
+	conf_init(cd);
+
+	if ((f = fopen(path, "r")) == NULL) {
+		snprintf(errbuf, len, "%s: %s", path, strerror(errno));
+		return (-1);
+	}
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineno++;
+
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		for (kw = line; isspace((unsigned char)*kw); kw++)
+			;
+		if (*kw == '\0')
+			continue;
+		for (arg = kw; *arg && !isspace((unsigned char)*arg); arg++)
+			;
+		if (*arg)
+			*arg++ = '\0';
+		while (isspace((unsigned char)*arg))
+			arg++;
+		for (p = arg + strlen(arg); p > arg &&
+		    isspace((unsigned char)p[-1]); p--)
+			;
+		*p = '\0';
+
+		if (*arg == '\0') {
+			snprintf(errbuf, len, "%s:%d: %s needs an argument",
+			    path, lineno, kw);
+			goto fail;
+		}
+
+		if (!strcmp(kw, "key")) {
+			if (conf_readkey(arg, cd->key) == -1) {
+				snprintf(errbuf, len, "%s:%d: unable to read "
+				    "authentication key %s", path, lineno, arg);
+				goto fail;
+			}
+			cd->use_key = 1;
+		} else if (!strcmp(kw, "timeout")) {
+			cd->timeout = strtol(arg, &p, 10);
+			if (*p != '\0' || cd->timeout < 0) {
+				snprintf(errbuf, len, "%s:%d: invalid timeout",
+				    path, lineno);
+				goto fail;
+			}
+		} else if (!strcmp(kw, "mac")) {
+			if (conf_macs(cd, arg) == -1) {
+				snprintf(errbuf, len, "%s:%d: unknown MAC",
+				    path, lineno);
+				goto fail;
+			}
+		} else if (!strcmp(kw, "idle")) {
+			if (!strcmp(arg, "yes"))
+				cd->idle = 1;
+			else if (!strcmp(arg, "no"))
+				cd->idle = 0;
+			else {
+				snprintf(errbuf, len, "%s:%d: idle must be "
+				    "yes or no", path, lineno);
+				goto fail;
+			}
+		} else if (!strcmp(kw, "force")) {
+			if (strlen(arg) >= PF_TABLE_NAME_SIZE) {
+				snprintf(errbuf, len, "%s:%d: table name too "
+				    "long", path, lineno);
+				goto fail;
+			}
+			strncpy(cd->force, arg, sizeof(cd->force) - 1);
+		} else if (!strcmp(kw, "protect")) {
+			if (conf_addprotect(cd, arg) == -1) {
+				snprintf(errbuf, len, "%s:%d: invalid prefix "
+				    "or too many prefixes", path, lineno);
+				goto fail;
+			}
+		} else if (!strcmp(kw, "ttl")) {
+			if (conf_addttl(cd, arg) == -1) {
+				snprintf(errbuf, len, "%s:%d: invalid lifetime "
+				    "or too many tables", path, lineno);
+				goto fail;
+			}
+		} else if (!strcmp(kw, "table")) {
+			if (conf_addtable(cd, arg) == -1) {
+				snprintf(errbuf, len, "%s:%d: invalid table "
+				    "name", path, lineno);
+				goto fail;
+			}
+		} else {
+			snprintf(errbuf, len, "%s:%d: unknown keyword %s",
+			    path, lineno, kw);
+			goto fail;
+		}
+	}
+
+	fclose(f);
+	return (0);
+
+fail:
+	fclose(f);
+	conf_free(cd);
+	return (-1);
+}
+
+static int
+writeall(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		p += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+static int
+readall(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (n == 0)
+			return (-1);
+		p += n;
+		len -= n;
+	}
+
+	return (0);
+}
+
+/* Send cd, or a failure if cd is NULL, to the other end of fd */
+int
+conf_send(int fd, struct confdata *cd)
+{
+	struct confdata fail;
+
+	if (cd == NULL) {
+		conf_init(&fail);
+		fail.ntables = -1;
+		cd = &fail;
+	}
+
+	if (writeall(fd, cd, sizeof(*cd)) == -1)
+		return (-1);
+	if (cd->ntables > 0 && writeall(fd, cd->tables,
+	    cd->ntables * sizeof(*cd->tables)) == -1)
+		return (-1);
+	if (cd->nprotect > 0 && writeall(fd, cd->protect,
+	    cd->nprotect * sizeof(*cd->protect)) == -1)
+		return (-1);
+	if (cd->nttls > 0 && writeall(fd, cd->ttls,
+	    cd->nttls * sizeof(*cd->ttls)) == -1)
+		return (-1);
+
+	return (0);
+}
+
+/* Receive settings sent by conf_send(). Returns -1 on failure. */
+int
+conf_recv(int fd, struct confdata *cd)
+{
+	if (readall(fd, cd, sizeof(*cd)) == -1)
+		return (-1);
+
+	cd->tables = NULL;
+	cd->protect = NULL;
+	cd->ttls = NULL;
+	if (cd->ntables < 0 || cd->ntables > TABLE_MAX ||
+	    cd->nprotect < 0 || cd->nprotect > PROTECT_MAX ||
+	    cd->nttls < 0 || cd->nttls > TABLE_MAX) {
+		conf_init(cd);
+		return (-1);
+	}
+
+	if (cd->ntables > 0) {
+		if ((cd->tables = calloc(cd->ntables,
+		    sizeof(*cd->tables))) == NULL ||
+		    readall(fd, cd->tables,
+		    cd->ntables * sizeof(*cd->tables)) == -1) {
+			conf_free(cd);
+			return (-1);
+		}
+	}
+
+	if (cd->nprotect > 0) {
+		if ((cd->protect = calloc(cd->nprotect,
+		    sizeof(*cd->protect))) == NULL ||
+		    readall(fd, cd->protect,
+		    cd->nprotect * sizeof(*cd->protect)) == -1) {
+			conf_free(cd);
+			return (-1);
+		}
+	}
+
+	if (cd->nttls > 0) {
+		if ((cd->ttls = calloc(cd->nttls,
+		    sizeof(*cd->ttls))) == NULL ||
+		    readall(fd, cd->ttls,
+		    cd->nttls * sizeof(*cd->ttls)) == -1) {
+			conf_free(cd);
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Build a runtime configuration from the command line settings in base
+ * overridden by the configuration file settings in file, which may be
+ * NULL. Returns NULL and a message in errstr on failure.
+ */
+struct conf *
+conf_build(struct confdata *base, struct confdata *file, const char **errstr)
+{
+	struct confdata *cd[2], *pcd = NULL;
+	struct conf *c;
+	int i, j, id;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL) {
+		*errstr = "out of memory";
+		return (NULL);
+	}
+
+	c->forced = -1;
+	c->macs = MAC_DEFAULT;
+	cd[0] = base;
+	cd[1] = file;
+
+	for (i = 0; i < 2 && cd[i] != NULL; i++) {
+		if (cd[i]->use_key) {
+			c->use_key = 1;
+			memcpy(c->key, cd[i]->key, sizeof(c->key));
+		}
+		if (cd[i]->timeout != -1)
+			c->timeout = cd[i]->timeout;
+		if (cd[i]->idle != -1)
+			c->idle = cd[i]->idle;
+		if (cd[i]->macs != -1)
+			c->macs = cd[i]->macs;
+		if (cd[i]->force[0] != '\0' &&
+		    (c->forced = table_intern(cd[i]->force)) == -1) {
+			*errstr = "invalid table name or too many tables";
+			goto fail;
+		}
+		for (j = 0; j < cd[i]->ntables; j++) {
+			if ((id = table_intern(cd[i]->tables[j])) == -1) {
+				*errstr = "invalid table name or too many "
+				    "tables";
+				goto fail;
+			}
+			c->allowed[id] = 1;
+			c->restricted = 1;
+		}
+		if (cd[i]->nprotect > 0)
+			pcd = cd[i];
+	}
+
+	/* Lifetimes default to the timeout, which is also the maximum */
+	for (id = 0; id < TABLE_MAX; id++) {
+		c->ttldef[id] = c->timeout;
+		c->ttlmax[id] = c->timeout;
+	}
+	for (i = 0; i < 2 && cd[i] != NULL; i++) {
+		for (j = 0; j < cd[i]->nttls; j++) {
+			if ((id = table_intern(cd[i]->ttls[j].table)) == -1) {
+				*errstr = "invalid table name or too many "
+				    "tables";
+				goto fail;
+			}
+			c->ttldef[id] = cd[i]->ttls[j].def;
+			c->ttlmax[id] = cd[i]->ttls[j].max;
+		}
+	}
+
+	if (pcd != NULL &&
+	    (c->protect = protect_build(pcd->protect, pcd->nprotect)) == NULL) {
+		*errstr = "out of memory";
+		goto fail;
+	}
+
+	return (c);
+
+fail:
+	conf_destroy(c);
+	return (NULL);
+}
+
+void
+conf_destroy(struct conf *c)
+{
+	if (c == NULL)
+		return;
+	protect_free(c->protect);
+	free(c);
+}
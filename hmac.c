@@ -68,3 +68,58 @@ hmac_verify(uint8_t *key, void *data, int datalen, uint8_t *md)
 
 	return (memcmp(md, md2, SHA1_DIGEST_LENGTH));
 }
+
+/*
+ * MAC dispatch. Every algorithm fills a SHA1_DIGEST_LENGTH digest and
+ * uses the same SHA1_DIGEST_LENGTH byte key.
+ */
+const char *mac_names[MAC_MAX] = {
+	"hmac-sha1",
+	"blake2s",
+	"siphash"
+};
+
+/* Return the MAC_* id of algorithm name or -1 */
+int
+mac_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < MAC_MAX; i++)
+		if (!strcmp(name, mac_names[i]))
+			return (i);
+
+	return (-1);
+}
+
+void
+mac_sign(int alg, uint8_t *key, void *data, int datalen, uint8_t *md)
+{
+	switch (alg) {
+	case MAC_BLAKE2S:
+		blake2s(md, SHA1_DIGEST_LENGTH, key, SHA1_DIGEST_LENGTH,
+		    data, datalen);
+		break;
+	case MAC_SIPHASH:
+		siphash128(md, key, data, datalen);
+		memset(md + 16, 0, SHA1_DIGEST_LENGTH - 16);
+		break;
+	default:
+		hmac(key, data, datalen, md);
+		break;
+	}
+}
+
+/* Returns 0 if md is the digest of data, comparing in constant time */
+int
+mac_verify(int alg, uint8_t *key, void *data, int datalen, uint8_t *md)
+{
+	uint8_t md2[SHA1_DIGEST_LENGTH], diff = 0;
+	int i;
+
+	mac_sign(alg, key, data, datalen, md2);
+	for (i = 0; i < SHA1_DIGEST_LENGTH; i++)
+		diff |= md[i] ^ md2[i];
+
+	return (diff != 0);
+}
@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Processing of received messages, split into stages so that the daemon
+ * and pftabled-replay run exactly the same code. Each stage returns
+ * MSG_OK or the reason the message was dropped. A datagram is checked
+ * and authenticated as a whole, then split into single commands with
+ * msg_entry() for the session, table and dispatch stages.
+ */
+
+#include "pftabled.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TTL_BITS	5	/* Significant bits of lifetimes clients ask for */
+
+/*
+ * Check length, version and timestamp of a datagram of len bytes
+ * received at time now and convert old versions in place.
+ */
+int
+msg_check(union pftabled_pkt *pkt, int len, time_t now)
+{
+	struct pftabled_batch *b = &pkt->batch;
+	struct pftabled_msg *msg = &pkt->msg;
+
+	if (len < 1)
+		return (MSG_SHORT);
+
+	if (pkt->version == PFTABLED_BATCH_VERSION) {
+		if (len < (int)PFTABLED_BATCH_LEN(1) ||
+		    ntohs(b->count) < 1 || ntohs(b->count) > BATCH_MAX ||
+		    len != (int)PFTABLED_BATCH_LEN(ntohs(b->count)))
+			return (MSG_SHORT);
+		if (b->mac >= MAC_MAX)
+			return (MSG_VERSION);
+		if (labs((long)(now - ntohl(b->timestamp))) > CLOCKDIFF)
+			return (MSG_TIMESTAMP);
+		return (MSG_OK);
+	}
+
+	if (len != sizeof(*msg))
+		return (MSG_SHORT);
+
+	if (msg->version > PFTABLED_MSG_VERSION ||
+	    (msg->version == 0x02 && msg->reserved >= MAC_MAX))
+		return (MSG_VERSION);
+
+	/* Transform packets from previous versions */
+	if (msg->version == 0x01)
+		msg->mask = 32;
+
+	if (labs((long)(now - ntohl(msg->timestamp))) > CLOCKDIFF)
+		return (MSG_TIMESTAMP);
+
+	return (MSG_OK);
+}
+
+/*
+ * Verify the digest of a datagram of len bytes passed by msg_check()
+ * with the MAC it names, if that is accepted.
+ */
+int
+msg_auth(struct conf *c, union pftabled_pkt *pkt, int len)
+{
+	uint8_t digest[SHA1_DIGEST_LENGTH];
+	int alg;
+
+	if (!c->use_key)
+		return (MSG_OK);
+
+	if (pkt->version == PFTABLED_BATCH_VERSION)
+		alg = pkt->batch.mac;
+	else if (pkt->version == 0x02)
+		alg = pkt->msg.reserved;
+	else
+		alg = MAC_HMAC_SHA1;
+	if (!(c->macs & 1 << alg))
+		return (MSG_MAC);
+
+	if (pkt->version == PFTABLED_BATCH_VERSION) {
+		memcpy(digest, pkt->batch.digest, sizeof(digest));
+		memset(pkt->batch.digest, 0, sizeof(digest));
+		if (mac_verify(alg, c->key, pkt, len, digest))
+			return (MSG_AUTH);
+	} else if (mac_verify(alg, c->key, &pkt->msg,
+	    sizeof(pkt->msg) - sizeof(pkt->msg.digest), pkt->msg.digest))
+		return (MSG_AUTH);
+
+	return (MSG_OK);
+}
+
+/* Number of commands in a datagram passed by msg_check() */
+int
+msg_count(union pftabled_pkt *pkt)
+{
+	if (pkt->version == PFTABLED_BATCH_VERSION)
+		return (ntohs(pkt->batch.count));
+
+	return (1);
+}
+
+/*
+ * Store command i of a datagram as a single message in msg and the
+ * lifetime it asks for, 0 if none, in ttl.
+ */
+void
+msg_entry(union pftabled_pkt *pkt, int i, struct pftabled_msg *msg,
+    uint32_t *ttl)
+{
+	struct pftabled_batch *b = &pkt->batch;
+
+	if (pkt->version != PFTABLED_BATCH_VERSION) {
+		*msg = pkt->msg;
+		*ttl = 0;
+		return;
+	}
+
+	memset(msg, 0, sizeof(*msg));
+	msg->version = b->version;
+	msg->cmd = b->entries[i].cmd;
+	msg->mask = b->entries[i].mask;
+	msg->addr = b->entries[i].addr;
+	memcpy(msg->table, b->table, sizeof(msg->table));
+	msg->timestamp = b->timestamp;
+	*ttl = ntohl(b->entries[i].ttl);
+}
+
+/* Store the session of a datagram passed by msg_check() in ack */
+void
+msg_ackreq(union pftabled_pkt *pkt, struct ackreq *ack)
+{
+	memset(ack, 0, sizeof(*ack));
+	if (pkt->version != PFTABLED_BATCH_VERSION)
+		return;
+
+	ack->session = ntohs(pkt->batch.session);
+	ack->seq = ntohs(pkt->batch.seq);
+	ack->mac = pkt->batch.mac;
+}
+
+/*
+ * Session stage: returns 1 if the command from from belongs to a batch
+ * of session a applied before, so it is skipped.
+ */
+int
+msg_seen(struct sockaddr_in *from, struct ackreq *a, time_t now)
+{
+	return (a->session && ack_seen(from, a, now));
+}
+
+/*
+ * Record the batch of session a as applied after its last command.
+ * Returns 1 with the acknowledgement to send filled in, else 0.
+ */
+int
+msg_applied(struct conf *c, struct sockaddr_in *from, struct ackreq *a,
+    time_t now, struct pftabled_ack *ack)
+{
+	if (!a->session || !a->last)
+		return (0);
+	ack_applied(c, from, a, now, ack);
+
+	return (1);
+}
+
+/* Select the table a message applies to and store its id in tid */
+int
+msg_table(struct conf *c, struct pftabled_msg *msg, int *tid)
+{
+	if (c->forced != -1)
+		*tid = c->forced;
+	else if (c->restricted ?
+	    ((*tid = table_lookup(msg->table)) == -1 || !c->allowed[*tid]) :
+	    (*tid = table_intern(msg->table)) == -1)
+		return (MSG_TABLE);
+
+	return (MSG_OK);
+}
+
+/*
+ * Return the lifetime of an address added to table tid by a client
+ * asking for ttl seconds, or 0 to keep it. Clients may ask for any
+ * lifetime up to the table maximum. A default of 0 keeps addresses
+ * even if the table has a maximum. Asked for lifetimes are rounded up
+ * to TTL_BITS significant bits, as the timeout queue needs a lane per
+ * distinct lifetime and a table may have no maximum.
+ */
+static uint32_t
+msg_ttl(struct conf *c, int tid, uint32_t ttl)
+{
+	uint64_t t;
+	int shift;
+
+	if (ttl == 0)
+		ttl = c->ttldef[tid];
+	else {
+		for (shift = 0; ttl >> shift >= 1U << TTL_BITS; shift++)
+			;
+		t = ((uint64_t)ttl + (1U << shift) - 1) >> shift << shift;
+		ttl = t > 0xffffffffU ? 0xffffffffU : t;
+	}
+	if (ttl && c->ttlmax[tid] && ttl > c->ttlmax[tid])
+		ttl = c->ttlmax[tid];
+
+	return (ttl);
+}
+
+/*
+ * Run the command of a message, refusing to add protected addresses.
+ * Addresses are added for the lifetime ttl allows in the table.
+ */
+int
+msg_dispatch(struct conf *c, const struct backend *be, int tid,
+    struct pftabled_msg *msg, uint32_t ttl)
+{
+	switch (msg->cmd) {
+	case PFTABLED_CMD_ADD:
+		cleanmask(&msg->addr, msg->mask);
+		if (c->protect != NULL &&
+		    protect_match(c->protect, &msg->addr, msg->mask))
+			return (MSG_PROTECTED);
+		be->add(tid, &msg->addr, msg->mask, msg_ttl(c, tid, ttl));
+		break;
+	case PFTABLED_CMD_DEL:
+		cleanmask(&msg->addr, msg->mask);
+		be->del(tid, &msg->addr, msg->mask);
+		break;
+	case PFTABLED_CMD_FLUSH:
+		be->flush(tid);
+		break;
+	default:
+		return (MSG_CMD);
+	}
+
+	return (MSG_OK);
+}
@@ -0,0 +1,541 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks of the per request building blocks, run by make bench.
+ * Prints one tab separated line per benchmark: name, parameter,
+ * operations, cycles and nanoseconds per operation. Cycles are read from
+ * the time stamp counter where there is one and are 0 elsewhere. Each
+ * benchmark but the timeout queue is run several times and the fastest
+ * run is reported, to compare builds on the same host.
+ */
+
+#include "pftabled.h"
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS		5
+#define TMO_MIN		1000
+#define PROTECT_N	100000	/* random protected prefixes */
+#define QUERIES		65536	/* distinct lookups, a power of 2 */
+
+struct result {
+	uint64_t	cycles;
+	uint64_t	ns;
+};
+
+static volatile uint32_t sink;
+static uint64_t ops = 1000000;
+
+static uint8_t key[SHA1_DIGEST_LENGTH];
+static struct conf *conf;
+
+static inline uint64_t
+cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32 | lo);
+#else
+	return (0);
+#endif
+}
+
+static uint64_t
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static void
+start(struct result *r)
+{
+	r->ns = nsec();
+	r->cycles = cycles();
+}
+
+static void
+stop(struct result *r)
+{
+	r->cycles = cycles() - r->cycles;
+	r->ns = nsec() - r->ns;
+}
+
+static void
+report(const char *name, const char *param, uint64_t n, struct result *r)
+{
+	printf("%s\t%s\t%llu\t%.1f\t%.1f\n", name, param,
+	    (unsigned long long)n, (double)r->cycles / n, (double)r->ns / n);
+	fflush(stdout);
+}
+
+/* Run fn(n) RUNS times and report the fastest */
+static void
+best(const char *name, const char *param, uint64_t n,
+    void (*fn)(uint64_t, struct result *))
+{
+	struct result r, min;
+	int i;
+
+	for (i = 0; i < RUNS; i++) {
+		fn(n, &r);
+		if (i == 0 || r.ns < min.ns)
+			min = r;
+	}
+	report(name, param, n, &min);
+}
+
+static void
+b_sha1(uint64_t n, struct result *r)
+{
+	uint32_t state[5] = { 0 };
+	uint8_t block[SHA1_BLOCK_LENGTH];
+	uint64_t i;
+
+	memset(block, 0xa5, sizeof(block));
+	start(r);
+	for (i = 0; i < n; i++) {
+		block[0] = i;
+		SHA1Transform(state, block);
+	}
+	stop(r);
+	sink = state[0];
+}
+
+static union pftabled_pkt msgpkt;	/* signed version 2 message */
+static union pftabled_pkt batchpkt;	/* signed batch of BATCH_MAX */
+
+static void
+b_hmac_msg(uint64_t n, struct result *r)
+{
+	uint8_t md[SHA1_DIGEST_LENGTH];
+	uint64_t i;
+
+	start(r);
+	for (i = 0; i < n; i++)
+		hmac(key, &msgpkt.msg, sizeof(msgpkt.msg) -
+		    sizeof(msgpkt.msg.digest), md);
+	stop(r);
+	sink = md[0];
+}
+
+static void
+b_hmac_verify_msg(uint64_t n, struct result *r)
+{
+	uint64_t i;
+	int bad = 0;
+
+	start(r);
+	for (i = 0; i < n; i++)
+		bad += hmac_verify(key, &msgpkt.msg, sizeof(msgpkt.msg) -
+		    sizeof(msgpkt.msg.digest), msgpkt.msg.digest) != 0;
+	stop(r);
+	if (bad)
+		errx(1, "hmac_verify failed");
+}
+
+static void
+b_hmac_batch(uint64_t n, struct result *r)
+{
+	uint8_t md[SHA1_DIGEST_LENGTH];
+	uint64_t i;
+
+	start(r);
+	for (i = 0; i < n; i++)
+		hmac(key, &batchpkt, PFTABLED_BATCH_LEN(BATCH_MAX), md);
+	stop(r);
+	sink = md[0];
+}
+
+static int alg;
+
+static void
+b_mac_verify_msg(uint64_t n, struct result *r)
+{
+	struct pftabled_msg msg = msgpkt.msg;
+	uint64_t i;
+	int bad = 0;
+
+	mac_sign(alg, key, &msg, sizeof(msg) - sizeof(msg.digest), msg.digest);
+	start(r);
+	for (i = 0; i < n; i++)
+		bad += mac_verify(alg, key, &msg, sizeof(msg) -
+		    sizeof(msg.digest), msg.digest) != 0;
+	stop(r);
+	if (bad)
+		errx(1, "mac_verify failed");
+}
+
+static void
+b_mac_verify_batch(uint64_t n, struct result *r)
+{
+	union pftabled_pkt pkt = batchpkt;
+	uint8_t md[SHA1_DIGEST_LENGTH];
+	uint64_t i;
+	int bad = 0;
+
+	memset(pkt.batch.digest, 0, sizeof(pkt.batch.digest));
+	mac_sign(alg, key, &pkt, PFTABLED_BATCH_LEN(BATCH_MAX), md);
+	start(r);
+	for (i = 0; i < n; i++)
+		bad += mac_verify(alg, key, &pkt,
+		    PFTABLED_BATCH_LEN(BATCH_MAX), md) != 0;
+	stop(r);
+	if (bad)
+		errx(1, "mac_verify failed");
+}
+
+static int cmask;
+
+static void
+b_cleanmask(uint64_t n, struct result *r)
+{
+	struct in_addr a;
+	uint32_t acc = 0;
+	uint64_t i;
+	uint8_t m = cmask;
+
+	start(r);
+	for (i = 0; i < n; i++) {
+		a.s_addr = (uint32_t)i * 2654435761U;
+		cleanmask(&a, m);
+		acc ^= a.s_addr;
+	}
+	stop(r);
+	sink = acc;
+}
+
+static struct protect *prot;
+static struct prefix queries[QUERIES];
+static uint32_t seed = 1;
+
+/* Reproducible xorshift, so runs compare across builds */
+static uint32_t
+rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return (seed);
+}
+
+/*
+ * Protect PROTECT_N random /20 to /32 prefixes. Half the queries are
+ * inside one of them, the other half anywhere, with a mask of 32 if
+ * single is set, otherwise of 8 to 31.
+ */
+static void
+protect_setup(int single)
+{
+	struct prefix *pfx;
+	int i;
+
+	if (prot == NULL) {
+		if ((pfx = calloc(PROTECT_N, sizeof(*pfx))) == NULL)
+			err(1, "calloc");
+		for (i = 0; i < PROTECT_N; i++) {
+			pfx[i].addr.s_addr = rnd();
+			pfx[i].mask = 20 + rnd() % 13;
+			cleanmask(&pfx[i].addr, pfx[i].mask);
+		}
+		if ((prot = protect_build(pfx, PROTECT_N)) == NULL)
+			err(1, "protect_build");
+		for (i = 0; i < QUERIES; i++)
+			queries[i].addr.s_addr = (i & 1) ?
+			    pfx[rnd() % PROTECT_N].addr.s_addr : rnd();
+		free(pfx);
+	}
+
+	for (i = 0; i < QUERIES; i++) {
+		queries[i].mask = single ? 32 : 8 + rnd() % 24;
+		cleanmask(&queries[i].addr, queries[i].mask);
+	}
+}
+
+static void
+b_protect_match(uint64_t n, struct result *r)
+{
+	uint64_t i;
+	uint32_t hits = 0;
+
+	start(r);
+	for (i = 0; i < n; i++)
+		hits += protect_match(prot, &queries[i & (QUERIES - 1)].addr,
+		    queries[i & (QUERIES - 1)].mask);
+	stop(r);
+	sink = hits;
+}
+
+static void
+b_check_msg(uint64_t n, struct result *r)
+{
+	union pftabled_pkt pkt = msgpkt;
+	time_t now = time(NULL);
+	uint64_t i;
+	int bad = 0;
+
+	start(r);
+	for (i = 0; i < n; i++)
+		bad += msg_check(&pkt, sizeof(pkt.msg), now) != MSG_OK;
+	stop(r);
+	if (bad)
+		errx(1, "msg_check failed");
+}
+
+static void
+b_check_batch(uint64_t n, struct result *r)
+{
+	time_t now = time(NULL);
+	uint64_t i;
+	int bad = 0;
+
+	start(r);
+	for (i = 0; i < n; i++)
+		bad += msg_check(&batchpkt, PFTABLED_BATCH_LEN(BATCH_MAX),
+		    now) != MSG_OK;
+	stop(r);
+	if (bad)
+		errx(1, "msg_check failed");
+}
+
+static void
+b_auth_msg(uint64_t n, struct result *r)
+{
+	union pftabled_pkt pkt = msgpkt;
+	uint64_t i;
+	int bad = 0;
+
+	start(r);
+	for (i = 0; i < n; i++)
+		bad += msg_auth(conf, &pkt, sizeof(pkt.msg)) != MSG_OK;
+	stop(r);
+	if (bad)
+		errx(1, "msg_auth failed");
+}
+
+static void
+b_auth_batch(uint64_t n, struct result *r)
+{
+	union pftabled_pkt pkt = batchpkt;
+	uint64_t i;
+	int bad = 0;
+
+	start(r);
+	for (i = 0; i < n; i++) {
+		/* msg_auth() zeroes the digest */
+		memcpy(pkt.batch.digest, batchpkt.batch.digest,
+		    sizeof(pkt.batch.digest));
+		bad += msg_auth(conf, &pkt, PFTABLED_BATCH_LEN(BATCH_MAX)) !=
+		    MSG_OK;
+	}
+	stop(r);
+	if (bad)
+		errx(1, "msg_auth failed");
+}
+
+static uint64_t nadded;
+
+static void
+stub_add(int tid, struct in_addr *ip, uint8_t mask, uint32_t ttl)
+{
+	nadded++;
+}
+
+static void
+stub_del(int tid, struct in_addr *ip, uint8_t mask)
+{
+}
+
+static void
+stub_flush(int tid)
+{
+}
+
+static const struct backend stub = { stub_add, stub_del, stub_flush };
+
+static void
+b_table_dispatch(uint64_t n, struct result *r)
+{
+	struct pftabled_msg msg;
+	uint64_t i;
+	int tid, bad = 0;
+
+	start(r);
+	for (i = 0; i < n; i++) {
+		msg = msgpkt.msg;
+		msg.addr.s_addr ^= (uint32_t)i;
+		bad += msg_table(conf, &msg, &tid) != MSG_OK ||
+		    msg_dispatch(conf, &stub, tid, &msg, 0) != MSG_OK;
+	}
+	stop(r);
+	if (bad)
+		errx(1, "msg_dispatch failed");
+}
+
+/* Queue n entries with nttl lifetimes, then expire them all */
+static void
+b_tmo(uint64_t n, int nttl)
+{
+	struct result add, pop;
+	struct in_addr a;
+	struct tmo *t;
+	time_t now = 1000000;
+	char param[32];
+	uint64_t i;
+
+	start(&add);
+	for (i = 0; i < n; i++) {
+		a.s_addr = (uint32_t)i;
+		if ((i & 1023) == 0)
+			now++;
+		if (tmo_add(1, &a, 32, 60 + (i % nttl) * 60, now) == -1)
+			err(1, "tmo_add");
+	}
+	stop(&add);
+
+	start(&pop);
+	while ((t = tmo_first()) != NULL) {
+		sink = t->expire;
+		tmo_pop();
+	}
+	stop(&pop);
+
+	snprintf(param, sizeof(param), "%llu/%d", (unsigned long long)n,
+	    nttl);
+	report("tmo_add", param, n, &add);
+	report("tmo_expire", param, n, &pop);
+}
+
+static void
+usage(int code)
+{
+	fprintf(stderr,
+	    "Usage: pftabled-bench [options...]\n"
+	    "-m entries  Largest timeout queue to time (default: 10000000)\n"
+	    "-n ops      Operations per run (default: 1000000)\n");
+	if (code)
+		exit(code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct confdata base;
+	const char *errstr;
+	char param[32];
+	uint64_t n, max = 10000000;
+	int ch, i;
+
+	while ((ch = getopt(argc, argv, "m:n:h")) != -1) {
+		switch (ch) {
+		case 'm':
+			max = strtoull(optarg, NULL, 10);
+			break;
+		case 'n':
+			if ((ops = strtoull(optarg, NULL, 10)) == 0)
+				usage(1);
+			break;
+		case 'h':
+		default:
+			usage(1);
+		}
+	}
+
+	for (i = 0; i < (int)sizeof(key); i++)
+		key[i] = i * 7 + 1;
+
+	conf_init(&base);
+	base.use_key = 1;
+	memcpy(base.key, key, sizeof(key));
+	if ((conf = conf_build(&base, NULL, &errstr)) == NULL)
+		errx(1, "%s", errstr);
+
+	msgpkt.msg.version = PFTABLED_MSG_VERSION;
+	msgpkt.msg.cmd = PFTABLED_CMD_ADD;
+	msgpkt.msg.mask = 32;
+	msgpkt.msg.addr.s_addr = htonl(0x0a000001);
+	strncpy(msgpkt.msg.table, "bench", sizeof(msgpkt.msg.table) - 1);
+	msgpkt.msg.timestamp = htonl(time(NULL));
+	hmac(key, &msgpkt.msg, sizeof(msgpkt.msg) - sizeof(msgpkt.msg.digest),
+	    msgpkt.msg.digest);
+
+	batchpkt.batch.version = PFTABLED_BATCH_VERSION;
+	batchpkt.batch.count = htons(BATCH_MAX);
+	batchpkt.batch.timestamp = htonl(time(NULL));
+	strncpy(batchpkt.batch.table, "bench",
+	    sizeof(batchpkt.batch.table) - 1);
+	for (i = 0; i < BATCH_MAX; i++) {
+		batchpkt.batch.entries[i].cmd = PFTABLED_CMD_ADD;
+		batchpkt.batch.entries[i].mask = 32;
+		batchpkt.batch.entries[i].addr.s_addr = htonl(0x0a000000 + i);
+	}
+	hmac(key, &batchpkt, PFTABLED_BATCH_LEN(BATCH_MAX),
+	    batchpkt.batch.digest);
+
+	printf("# name\tparam\tops\tcycles/op\tns/op\n");
+
+	best("sha1_transform", "64", ops, b_sha1);
+	best("hmac", "msg", ops, b_hmac_msg);
+	best("hmac_verify", "msg", ops, b_hmac_verify_msg);
+	best("hmac", "batch64", ops / 8, b_hmac_batch);
+	for (alg = 0; alg < MAC_MAX; alg++) {
+		snprintf(param, sizeof(param), "msg/%s", mac_names[alg]);
+		best("mac_verify", param, ops, b_mac_verify_msg);
+		snprintf(param, sizeof(param), "batch64/%s", mac_names[alg]);
+		best("mac_verify", param, ops / 8, b_mac_verify_batch);
+	}
+	for (cmask = 0; cmask <= 32; cmask++) {
+		snprintf(param, sizeof(param), "%d", cmask);
+		best("cleanmask", param, ops, b_cleanmask);
+	}
+	protect_setup(1);
+	best("protect_match", "100k/single", ops, b_protect_match);
+	protect_setup(0);
+	best("protect_match", "100k/prefix", ops, b_protect_match);
+	best("msg_check", "msg", ops, b_check_msg);
+	best("msg_check", "batch64", ops, b_check_batch);
+	best("msg_auth", "msg", ops, b_auth_msg);
+	best("msg_auth", "batch64", ops / 8, b_auth_batch);
+	best("msg_table_dispatch", "msg", ops, b_table_dispatch);
+
+	for (n = TMO_MIN; n <= max; n *= 10) {
+		b_tmo(n, 1);
+		b_tmo(n, 16);
+	}
+
+	return (0);
+}
@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,6 +30,36 @@
 #include <time.h>
 #include <unistd.h>
 
+#define RETRY_MIN	200	/* Milliseconds until the first retransmission */
+#define RETRY_MAX	3200
+
+/* Batch sent with acknowledgements (-A) */
+struct slot {
+	struct pftabled_batch	b;
+	int			n;
+	int			tries;
+	int			done;		/* acknowledged or given up */
+	uint64_t		due;		/* next retransmission */
+	uint64_t		sent;		/* number of last transmission */
+};
+
+static int s;
+static struct sockaddr_in dst;
+static uint8_t key[SHA1_DIGEST_LENGTH];
+static int use_key = 0;
+static int mac = MAC_HMAC_SHA1;
+static long ttl = -1;
+static char table[PF_TABLE_NAME_SIZE];
+static char *cmdarg, *iparg;	/* command line command, NULL for stdin */
+static int cmdsent = 0;
+static uint16_t session;
+static uint64_t xmits = 0;	/* transmissions with -A */
+static uint64_t ackedxmit = 0;	/* latest transmission acknowledged */
+
+static char inbuf[4096];	/* standard input not yet parsed */
+static size_t inlen = 0;
+static int ineof = 0;
+
 static void
 fatal(char *text, char *arg)
 {
@@ -41,33 +72,325 @@ static void
 usage(int code)
 {
 	fprintf(stderr, "\nUsage: "
-	    "pftabled-client [-k keyfile] host port table cmd [ip[/mask]]\n"
+	    "pftabled-client [-A] [-k keyfile] [-m mac] [-r tries] [-T ttl] "
+	    "[-W window]\n"
+	    "                host port table [cmd [ip[/mask]]]\n"
 	    "\n"
 	    "host      Host where pftabled is running\n"
 	    "port      Port number at host\n"
 	    "table     Name of table\n"
-	    "cmd       One of: add, del or flush.\n"
+	    "cmd       One of: add, del or flush. Without cmd, commands are\n"
+	    "          read from standard input, one per line\n"
 	    "ip[/mask] IP or network to add or delete from table\n"
-	    "keyfile   Name of file to read key from\n\n");
+	    "keyfile   Name of file to read key from\n"
+	    "mac       One of: hmac-sha1 (default), blake2s or siphash\n"
+	    "ttl       Seconds until an added IP is removed\n"
+	    "-A        Wait for acknowledgements, resending lost commands\n"
+	    "tries     Attempts to send commands with -A (default: 5)\n"
+	    "window    Batches of commands unacknowledged at most "
+	    "(default: 16)\n\n");
 	if (code)
 		exit(code);
 }
 
+static uint64_t
+msec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/* Parse command cmd with address ip, which may be NULL, into e */
+static void
+parse(struct pftabled_entry *e, char *cmd, char *ip)
+{
+	char *slash;
+
+	memset(e, 0, sizeof(*e));
+
+	if (!strcmp(cmd, "add"))
+		e->cmd = PFTABLED_CMD_ADD;
+	else if (!strcmp(cmd, "del"))
+		e->cmd = PFTABLED_CMD_DEL;
+	else if (!strcmp(cmd, "flush"))
+		e->cmd = PFTABLED_CMD_FLUSH;
+	else
+		fatal("Unknown command '%s'\n", cmd);
+
+	if (e->cmd == PFTABLED_CMD_FLUSH)
+		return;
+
+	if (ip == NULL)
+		fatal("Missing address for '%s'\n", cmd);
+
+	if ((slash = strchr(ip, '/')) != NULL) {
+		e->mask = (uint8_t)atoi(slash+1);
+		if (e->mask < 1 || e->mask > 32)
+			fatal("Invalid network mask '%s'\n", slash);
+		*slash = '\0';
+	} else
+		e->mask = 32;
+
+	if (inet_pton(AF_INET, ip, &e->addr) != 1)
+		fatal("Unable to parse '%s'\n", ip);
+
+	if (ttl != -1)
+		e->ttl = htonl(ttl);
+}
+
+/*
+ * Return the next line of standard input, NULL if there is none. Waits
+ * for input only if wait is set.
+ */
+static char *
+nextline(int wait)
+{
+	static char line[sizeof(inbuf) + 1];
+	struct pollfd pfd;
+	char *nl;
+	size_t len;
+	ssize_t n;
+
+	for (;;) {
+		nl = memchr(inbuf, '\n', inlen);
+		if (nl != NULL || (ineof && inlen > 0)) {
+			len = nl != NULL ? (size_t)(nl - inbuf) + 1 : inlen;
+			memcpy(line, inbuf, len);
+			line[len] = '\0';
+			memmove(inbuf, inbuf + len, inlen - len);
+			inlen -= len;
+			return (line);
+		}
+		if (ineof)
+			return (NULL);
+		if (inlen == sizeof(inbuf))
+			fatal("Line too long\n", NULL);
+
+		pfd.fd = STDIN_FILENO;
+		pfd.events = POLLIN;
+		if (!wait && poll(&pfd, 1, 0) == 0)
+			return (NULL);
+		n = read(STDIN_FILENO, inbuf + inlen, sizeof(inbuf) - inlen);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			ineof = 1;
+		else
+			inlen += n;
+	}
+}
+
+/* Returns 1 once all commands were read */
+static int
+cmdsdone(void)
+{
+	if (cmdarg != NULL)
+		return (cmdsent);
+
+	return (ineof && inlen == 0);
+}
+
+/*
+ * Fill b with the next commands, the one from the command line or up to
+ * BATCH_MAX from standard input. Waits for the first command if wait is
+ * set, but never for more. Returns their number.
+ */
+static int
+readcmds(struct pftabled_batch *b, int wait)
+{
+	char *line, *cmd, *ip, *p;
+	int n = 0;
+
+	memset(b, 0, sizeof(*b));
+	b->version = PFTABLED_BATCH_VERSION;
+	b->mac = mac;
+	memcpy(b->table, table, sizeof(b->table));
+
+	if (cmdarg != NULL) {
+		if (cmdsent)
+			return (0);
+		cmdsent = 1;
+		parse(&b->entries[0], cmdarg, iparg);
+		return (1);
+	}
+
+	while (n < BATCH_MAX && (line = nextline(wait && n == 0)) != NULL) {
+		if ((p = strchr(line, '#')) != NULL)
+			*p = '\0';
+		if ((cmd = strtok(line, " \t\n")) == NULL)
+			continue;
+		ip = strtok(NULL, " \t\n");
+		parse(&b->entries[n++], cmd, ip);
+	}
+
+	return (n);
+}
+
+/* Sign and send a batch of n commands. Returns -1 if sending failed. */
+static int
+sendbatch(struct pftabled_batch *b, int n)
+{
+	b->count = htons(n);
+	b->timestamp = htonl(time(NULL));
+	memset(b->digest, 0, sizeof(b->digest));
+	if (use_key)
+		mac_sign(mac, key, b, PFTABLED_BATCH_LEN(n), b->digest);
+
+	if (sendto(s, b, PFTABLED_BATCH_LEN(n), 0, (struct sockaddr *)&dst,
+	    sizeof(dst)) == -1)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Mark the batches in the window covered by acknowledgement ack and
+ * note the latest transmission it confirms. Batches sent before that
+ * but still missing were lost.
+ */
+static void
+ackrecv(struct pftabled_ack *ack, int len, struct slot *win, int head,
+    int inflight)
+{
+	uint8_t md[SHA1_DIGEST_LENGTH];
+	uint32_t applied;
+	struct slot *sl;
+	int i, d;
+
+	if (len != sizeof(*ack) || ack->version != PFTABLED_ACK_VERSION ||
+	    ntohs(ack->session) != session)
+		return;
+	if (use_key) {
+		memcpy(md, ack->digest, sizeof(md));
+		memset(ack->digest, 0, sizeof(ack->digest));
+		if (ack->mac != mac ||
+		    mac_verify(mac, key, ack, sizeof(*ack), md))
+			return;
+	}
+
+	applied = ntohl(ack->applied);
+	for (i = 0; i < inflight; i++) {
+		sl = &win[(head + i) % ACK_WINDOW];
+		d = (int16_t)(ntohs(ack->seq) - ntohs(sl->b.seq));
+		if (d < 0 || d >= ACK_WINDOW || !(applied >> d & 1))
+			continue;
+		sl->done = 1;
+		if (sl->sent > ackedxmit)
+			ackedxmit = sl->sent;
+	}
+}
+
+/*
+ * Send all commands in batches, keeping up to window of them
+ * unacknowledged. A batch is sent again when a batch sent after it is
+ * acknowledged first, or else after a timeout with backoff, until it is
+ * acknowledged or was sent tries times. Returns the number of commands
+ * not acknowledged.
+ */
+static int
+reliable(int window, int tries)
+{
+	struct slot win[ACK_WINDOW], *sl;
+	struct pftabled_ack ack;
+	struct pollfd pfd[2];
+	uint64_t now, next;
+	uint16_t seq;
+	int i, n, head = 0, inflight = 0, eof = 0, failed = 0;
+
+	srandom(getpid() ^ time(NULL));
+	session = random() % 0xffff + 1;
+	seq = random();
+
+	pfd[0].fd = s;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = STDIN_FILENO;
+	pfd[1].events = POLLIN;
+
+	for (;;) {
+		/* Fill the window, waiting for input only if it is empty */
+		while (!eof && inflight < window) {
+			sl = &win[(head + inflight) % ACK_WINDOW];
+			if ((sl->n = readcmds(&sl->b, inflight == 0)) == 0) {
+				eof = cmdsdone();
+				break;
+			}
+			sl->b.session = htons(session);
+			sl->b.seq = htons(seq++);
+			sl->tries = 1;
+			sl->done = 0;
+			sl->due = msec() + RETRY_MIN;
+			sl->sent = ++xmits;
+			(void)sendbatch(&sl->b, sl->n);
+			inflight++;
+		}
+
+		/* Slide past acknowledged batches */
+		while (inflight > 0 && win[head].done) {
+			head = (head + 1) % ACK_WINDOW;
+			inflight--;
+		}
+		if (inflight == 0) {
+			if (eof)
+				break;
+			continue;
+		}
+
+		now = msec();
+		next = now + RETRY_MAX;
+		for (i = 0; i < inflight; i++) {
+			sl = &win[(head + i) % ACK_WINDOW];
+			if (!sl->done && sl->due < next)
+				next = sl->due;
+		}
+		/* Wait for acknowledgements, and input if there is room */
+		if (next > now)
+			poll(pfd, !eof && inflight < window ? 2 : 1,
+			    next - now);
+
+		while ((n = recv(s, &ack, sizeof(ack), MSG_DONTWAIT)) > 0)
+			ackrecv(&ack, n, win, head, inflight);
+
+		/* Send again what is still missing */
+		now = msec();
+		for (i = 0; i < inflight; i++) {
+			sl = &win[(head + i) % ACK_WINDOW];
+			if (sl->done || (sl->due > now && sl->sent > ackedxmit))
+				continue;
+			if (sl->tries == tries) {
+				failed += sl->n;
+				sl->done = 1;
+				continue;
+			}
+			sl->sent = ++xmits;
+			(void)sendbatch(&sl->b, sl->n);
+			sl->due = now + (RETRY_MIN << sl->tries < RETRY_MAX ?
+			    RETRY_MIN << sl->tries : RETRY_MAX);
+			sl->tries++;
+		}
+	}
+
+	return (failed);
+}
+
 int
 main(int argc, char *argv[])
 {
 	struct sockaddr_in src;
-	struct sockaddr_in dst;
 	struct hostent *host;
 	struct pftabled_msg msg;
-	char key[SHA1_DIGEST_LENGTH];
-	char *slash;
+	struct pftabled_batch b;
+	char *end;
 	int keyfile;
-	int use_key = 0;
-	int s, ch;
+	int acked = 0, tries = 5, window = 16;
+	int n, ch;
 
-	while ((ch = getopt(argc, argv, "k:h")) != -1) {
+	while ((ch = getopt(argc, argv, "Ak:m:r:T:W:h")) != -1) {
 		switch (ch) {
+		case 'A':
+			acked = 1;
+			break;
 		case 'k':
 			use_key = 1;
 			keyfile = open(optarg, O_RDONLY, 0);
@@ -75,6 +398,24 @@ main(int argc, char *argv[])
 				fatal("unable to read key file\n", NULL);
 			close(keyfile);
 			break;
+		case 'm':
+			if ((mac = mac_lookup(optarg)) == -1)
+				fatal("Unknown MAC '%s'\n", optarg);
+			break;
+		case 'r':
+			if ((tries = atoi(optarg)) < 1)
+				fatal("Invalid tries '%s'\n", optarg);
+			break;
+		case 'T':
+			ttl = strtol(optarg, &end, 10);
+			if (*end != '\0' || ttl < 0 || ttl > 0xffffffffL)
+				fatal("Invalid ttl '%s'\n", optarg);
+			break;
+		case 'W':
+			window = atoi(optarg);
+			if (window < 1 || window > ACK_WINDOW)
+				fatal("Invalid window '%s'\n", optarg);
+			break;
 		case 'h':
 		default:
 			usage(1);
@@ -83,7 +424,7 @@ main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc < 4)
+	if (argc < 3)
 		usage(1);
 
 	if ((s = socket(AF_INET, SOCK_DGRAM, 0)) == -1)
@@ -107,44 +448,47 @@ main(int argc, char *argv[])
 	dst.sin_port = htons(atoi(*argv));
 	--argc, ++argv;
 
-	memset(&msg, 0, sizeof(msg));
-	msg.version = PFTABLED_MSG_VERSION;
-	msg.timestamp = htonl(time(NULL));
-
-	if (strlen(*argv) > sizeof(msg.table))
+	if (strlen(*argv) > sizeof(table))
 		fatal("Table name '%s' too long\n", *argv);
 
-	strncpy(msg.table, *argv, strlen(*argv));
-	--argc, ++argv;
-
-	if (!strcmp(*argv, "add"))
-		msg.cmd = PFTABLED_CMD_ADD;
-	else if (!strcmp(*argv, "del"))
-		msg.cmd = PFTABLED_CMD_DEL;
-	else if (!strcmp(*argv, "flush"))
-		msg.cmd = PFTABLED_CMD_FLUSH;
-	else
-		fatal("Unknown command '%s'\n", *argv);
+	strncpy(table, *argv, sizeof(table));
 	--argc, ++argv;
 
-	if (msg.cmd != PFTABLED_CMD_FLUSH) {
-		if (!argc)
-			usage(1);
+	if (argc > 0) {
+		cmdarg = argv[0];
+		iparg = argc > 1 ? argv[1] : NULL;
+	}
 
-		if ((slash = strchr(*argv, '/')) != NULL) {
-			msg.mask = (uint8_t)atoi(slash+1);
-			if (msg.mask < 1 || msg.mask > 32)
-				fatal("Invalid network mask '%s'\n", slash);
-			*slash = '\0';
-		} else
-			msg.mask = 32;
+	if (acked) {
+		if ((n = reliable(window, tries)) > 0) {
+			fprintf(stderr, "pftabled-client: %d commands not "
+			    "acknowledged\n", n);
+			exit(1);
+		}
+		return 0;
+	}
 
-		if (inet_pton(AF_INET, *argv, &msg.addr) != 1)
-			fatal("Unable to parse '%s'\n", *argv);
+	/* Batches for commands from stdin or with a lifetime */
+	if (cmdarg == NULL || ttl != -1) {
+		while ((n = readcmds(&b, 1)) > 0)
+			if (sendbatch(&b, n) == -1)
+				fatal("Unable to send message\n", NULL);
+		return 0;
 	}
 
+	readcmds(&b, 1);
+	memset(&msg, 0, sizeof(msg));
+	msg.version = PFTABLED_MSG_VERSION;
+	msg.reserved = mac;
+	msg.timestamp = htonl(time(NULL));
+	memcpy(msg.table, table, sizeof(msg.table));
+	msg.cmd = b.entries[0].cmd;
+	msg.mask = b.entries[0].mask;
+	msg.addr = b.entries[0].addr;
+
 	if (use_key)
-		hmac(key, &msg, sizeof(msg) - sizeof(msg.digest), msg.digest);
+		mac_sign(mac, key, &msg, sizeof(msg) - sizeof(msg.digest),
+		    msg.digest);
 
 	if (sendto(s, &msg, sizeof(msg), 0, (struct sockaddr *)&dst,
 		    sizeof(dst)) == -1)
@@ -0,0 +1,644 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Relay: accept requests from local clients, drop repeated commands
+ * within a short window and forward the rest as signed batch messages
+ * to any number of pftabled servers.
+ *
+ * Commands are collected per table. When the window ends, or a table
+ * has BATCH_MAX commands, the batch is queued for every destination.
+ * A command is a duplicate if the last command seen for the same table
+ * and prefix in the current window was the same, so add, del, add is
+ * forwarded as is. A flush forgets the commands seen for its table.
+ *
+ * Each destination has its own queue and connected socket. Batches are
+ * signed when sent, so a batch that waited for a retry still passes the
+ * timestamp check. A send failing with a transient error is retried
+ * shortly, one failing because the destination is unreachable after an
+ * increasing delay, up to a number of attempts.
+ */
+
+#include "pftabled.h"
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RELAY_PORT	56790
+#define SERVER_PORT	56789
+#define DEST_MAX	64
+#define QUEUE_MAX	1024	/* Batches queued per destination */
+#define DEDUP_BITS	16	/* Commands remembered per window */
+#define RETRY_SOON	10	/* Milliseconds to wait after ENOBUFS */
+#define RETRY_MIN	100	/* Milliseconds to wait after first failure */
+#define RETRY_MAX	5000
+
+#define MSEC		1000000ULL
+
+/* Batch being collected for a table */
+struct pending {
+	struct pftabled_batch	 b;
+	int			 n;
+	int			 dirty;		/* listed in dirty[] */
+	uint64_t		 first;		/* receive time of first */
+};
+
+/* Batch queued for a destination */
+struct out {
+	struct pftabled_batch	 b;
+	uint64_t		 first;
+	uint64_t		 next;		/* earliest time to send */
+	int			 tries;
+};
+
+struct dest {
+	char			*name;
+	int			 sock;
+	struct out		*queue;
+	int			 head;
+	int			 len;
+	uint64_t		 sent;
+	uint64_t		 commands;
+	uint64_t		 retries;
+	uint64_t		 dropped;
+	uint64_t		 latsum;	/* ns */
+	uint64_t		 latmax;
+};
+
+struct slot {
+	uint64_t		 key;
+	uint32_t		 gen;
+	uint32_t		 ttl;
+	uint8_t			 cmd;
+	uint32_t		 flushes;	/* of the table when stored */
+};
+
+static int use_syslog = 0;
+static int verbose = 0;
+
+static struct conf *conf;	/* Verifies local requests */
+static uint8_t key[SHA1_DIGEST_LENGTH];
+static int use_key = 0;		/* Sign forwarded batches */
+static int mac = MAC_HMAC_SHA1;
+static int maxtries = 5;
+
+static struct dest dests[DEST_MAX];
+static int ndests = 0;
+
+static struct pending *pending[TABLE_MAX];
+static uint16_t dirty[TABLE_MAX];
+static int ndirty = 0;
+
+static struct slot slots[1 << DEDUP_BITS];
+static uint32_t gen = 1;
+static int used = 0;		/* slots used in this window */
+static uint32_t flushes[TABLE_MAX];	/* slots of older flushes are stale */
+
+static uint64_t received, commands, duplicates, rejected;
+static uint64_t forwarded, batches;
+
+static volatile sig_atomic_t want_stats = 0;
+static volatile sig_atomic_t want_quit = 0;
+
+static void
+logit(int level, const char *fmt, ...)
+{
+	va_list ap;
+	extern char *__progname;
+
+	va_start(ap, fmt);
+
+	if (use_syslog) {
+		vsyslog(level, fmt, ap);
+	} else {
+		fprintf(stderr, "%s: ", __progname);
+		vfprintf(stderr, fmt, ap);
+		if (strchr(fmt, '\n') == NULL)
+			fprintf(stderr, "\n");
+	}
+
+	va_end(ap);
+}
+
+static uint64_t
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+/*
+ * Remember cmd with lifetime ttl as the last command for tid and ip/mask
+ * in this window. Returns 1 if it was the last command already.
+ */
+static int
+duplicate(int tid, struct in_addr *ip, uint8_t mask, uint8_t cmd,
+    uint32_t ttl)
+{
+	uint64_t k;
+	uint32_t i, mask_ = (1 << DEDUP_BITS) - 1;
+
+	k = (uint64_t)tid << 40 | (uint64_t)mask << 32 | ntohl(ip->s_addr);
+	i = (k * 0x9E3779B97F4A7C15ULL) >> (64 - DEDUP_BITS);
+
+	for (;; i = (i + 1) & mask_) {
+		if (slots[i].gen != gen) {
+			/* Keep the table at most half full */
+			if (used >= (1 << DEDUP_BITS) / 2)
+				return (0);
+			used++;
+			slots[i].gen = gen;
+			slots[i].key = k;
+			slots[i].cmd = cmd;
+			slots[i].ttl = ttl;
+			slots[i].flushes = flushes[tid];
+			return (0);
+		}
+		if (slots[i].key == k) {
+			if (slots[i].flushes == flushes[tid] &&
+			    slots[i].cmd == cmd && slots[i].ttl == ttl)
+				return (1);
+			slots[i].cmd = cmd;
+			slots[i].ttl = ttl;
+			slots[i].flushes = flushes[tid];
+			return (0);
+		}
+	}
+}
+
+/* Forget the commands seen in this window */
+static void
+forget(void)
+{
+	gen++;
+	used = 0;
+}
+
+/* Queue the batch collected for table tid for every destination */
+static void
+seal(int tid)
+{
+	struct pending *p = pending[tid];
+	struct dest *d;
+	struct out *o;
+	int i;
+
+	if (p == NULL || p->n == 0)
+		return;
+
+	p->b.version = PFTABLED_BATCH_VERSION;
+	p->b.mac = mac;
+	p->b.count = htons(p->n);
+	p->b.session = 0;
+	p->b.seq = 0;
+	memcpy(p->b.table, table_name(tid), sizeof(p->b.table));
+
+	for (i = 0; i < ndests; i++) {
+		d = &dests[i];
+		if (d->len == QUEUE_MAX) {
+			/* Drop the oldest batch */
+			d->dropped++;
+			d->head = (d->head + 1) % QUEUE_MAX;
+			d->len--;
+		}
+		o = &d->queue[(d->head + d->len++) % QUEUE_MAX];
+		memcpy(&o->b, &p->b, PFTABLED_BATCH_LEN(p->n));
+		o->first = p->first;
+		o->next = 0;
+		o->tries = 0;
+	}
+
+	batches++;
+	p->n = 0;
+}
+
+static void
+seal_all(void)
+{
+	int tid;
+
+	while (ndirty > 0) {
+		tid = dirty[--ndirty];
+		pending[tid]->dirty = 0;
+		seal(tid);
+	}
+	forget();
+}
+
+static void
+collect(int tid, struct pftabled_msg *msg, uint32_t ttl, uint64_t now)
+{
+	struct pending *p;
+	struct pftabled_entry *e;
+
+	if ((p = pending[tid]) == NULL) {
+		if ((p = calloc(1, sizeof(*p))) == NULL)
+			err(1, "calloc");
+		pending[tid] = p;
+	}
+
+	if (!p->dirty) {
+		p->dirty = 1;
+		dirty[ndirty++] = tid;
+	}
+	if (p->n == 0)
+		p->first = now;
+
+	forwarded++;
+	e = &p->b.entries[p->n++];
+	e->cmd = msg->cmd;
+	e->mask = msg->mask;
+	e->reserved = 0;
+	e->addr = msg->addr;
+	e->ttl = htonl(ttl);
+
+	if (p->n == BATCH_MAX)
+		seal(tid);
+}
+
+/* Handle one command received from a local client */
+static void
+relay(struct pftabled_msg *msg, uint32_t ttl, struct sockaddr_in *from,
+    uint64_t now)
+{
+	int tid;
+
+	commands++;
+
+	if ((tid = table_intern(msg->table)) == -1 ||
+	    (msg->cmd != PFTABLED_CMD_ADD && msg->cmd != PFTABLED_CMD_DEL &&
+	    msg->cmd != PFTABLED_CMD_FLUSH)) {
+		rejected++;
+		if (verbose)
+			logit(LOG_ERR, "%s from %s\n", msg_errors[tid == -1 ?
+			    MSG_TABLE : MSG_CMD], inet_ntoa(from->sin_addr));
+		return;
+	}
+
+	if (msg->cmd == PFTABLED_CMD_FLUSH) {
+		memset(&msg->addr, 0, sizeof(msg->addr));
+		msg->mask = 0;
+		/* Keeps the slots of tid in place, so probing still works */
+		flushes[tid]++;
+	} else {
+		cleanmask(&msg->addr, msg->mask);
+		if (duplicate(tid, &msg->addr, msg->mask, msg->cmd, ttl)) {
+			duplicates++;
+			return;
+		}
+	}
+
+	collect(tid, msg, ttl, now);
+}
+
+/* Send queued batches to destination d */
+static void
+flush_dest(struct dest *d, uint64_t now)
+{
+	struct out *o;
+	size_t len;
+	uint64_t wait;
+
+	while (d->len > 0) {
+		o = &d->queue[d->head];
+		if (o->next > now)
+			return;
+
+		len = PFTABLED_BATCH_LEN(ntohs(o->b.count));
+		o->b.timestamp = htonl(time(NULL));
+		memset(o->b.digest, 0, sizeof(o->b.digest));
+		if (use_key)
+			mac_sign(mac, key, &o->b, len, o->b.digest);
+
+		if (send(d->sock, &o->b, len, 0) == -1) {
+			if (errno == EAGAIN || errno == ENOBUFS ||
+			    errno == EINTR) {
+				o->next = now + RETRY_SOON * MSEC;
+				return;
+			}
+			if (++o->tries >= maxtries) {
+				logit(LOG_ERR, "%s: %s, batch dropped\n",
+				    d->name, strerror(errno));
+				d->dropped++;
+			} else {
+				d->retries++;
+				wait = RETRY_MIN << (o->tries - 1);
+				o->next = now + (wait < RETRY_MAX ?
+				    wait : RETRY_MAX) * MSEC;
+				return;
+			}
+		} else {
+			d->sent++;
+			d->commands += ntohs(o->b.count);
+			d->latsum += now - o->first;
+			if (now - o->first > d->latmax)
+				d->latmax = now - o->first;
+		}
+
+		d->head = (d->head + 1) % QUEUE_MAX;
+		d->len--;
+	}
+}
+
+static void
+log_stats(void)
+{
+	struct dest *d;
+	int i;
+
+	logit(LOG_INFO, "%llu datagrams, %llu commands, %llu duplicates "
+	    "(%.1f%%), %llu rejected, %llu batches (%.1f commands each)\n",
+	    (unsigned long long)received, (unsigned long long)commands,
+	    (unsigned long long)duplicates,
+	    commands ? 100.0 * duplicates / commands : 0.0,
+	    (unsigned long long)rejected, (unsigned long long)batches,
+	    batches ? (double)forwarded / batches : 0.0);
+
+	for (i = 0; i < ndests; i++) {
+		d = &dests[i];
+		logit(LOG_INFO, "%s: %llu batches, %llu commands, "
+		    "%llu retries, %llu dropped, %d queued, "
+		    "latency avg %.1f ms, max %.1f ms\n", d->name,
+		    (unsigned long long)d->sent,
+		    (unsigned long long)d->commands,
+		    (unsigned long long)d->retries,
+		    (unsigned long long)d->dropped, d->len,
+		    d->sent ? (double)d->latsum / d->sent / MSEC : 0.0,
+		    (double)d->latmax / MSEC);
+	}
+}
+
+static void
+sigusr1(int sig)
+{
+	want_stats = 1;
+}
+
+static void
+sigterm(int sig)
+{
+	want_quit = 1;
+}
+
+static void
+adddest(char *arg)
+{
+	struct sockaddr_in sin;
+	struct hostent *host;
+	struct dest *d;
+	char *colon;
+	int port = SERVER_PORT;
+
+	if (ndests == DEST_MAX)
+		errx(1, "too many destinations");
+	d = &dests[ndests];
+
+	if ((d->name = strdup(arg)) == NULL)
+		err(1, "strdup");
+	if ((colon = strrchr(arg, ':')) != NULL) {
+		*colon++ = '\0';
+		if ((port = strtol(colon, NULL, 10)) <= 0 || port > 65535)
+			errx(1, "invalid port in %s", d->name);
+	}
+
+	if ((host = gethostbyname(arg)) == NULL)
+		errx(1, "unable to resolve %s", arg);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	memcpy(&sin.sin_addr, host->h_addr, sizeof(sin.sin_addr));
+
+	if ((d->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+		err(1, "socket");
+	if (connect(d->sock, (struct sockaddr *)&sin, sizeof(sin)) == -1)
+		err(1, "connect %s", d->name);
+	if ((d->queue = calloc(QUEUE_MAX, sizeof(*d->queue))) == NULL)
+		err(1, "calloc");
+
+	ndests++;
+}
+
+static void
+usage(int code)
+{
+	fprintf(stderr,
+	    "Usage: pftabled-relay [options...] host[:port] ...\n"
+	    "-d          Run as daemon in the background\n"
+	    "-v          Log all rejected requests\n"
+	    "-a address  Bind to this address (default: 127.0.0.1)\n"
+	    "-k keyfile  Sign forwarded batches with key from file\n"
+	    "-K keyfile  Verify local requests with key from file\n"
+	    "-m mac      Sign with hmac-sha1 (default), blake2s or siphash\n"
+	    "-p port     Bind to this port (default: 56790)\n"
+	    "-r tries    Attempts to send a batch (default: 5)\n"
+	    "-w msec     Collect commands for msec ms (default: 100)\n");
+	if (code)
+		exit(code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct sockaddr_in laddr, from;
+	socklen_t fromlen;
+	union pftabled_pkt pkt;
+	struct pftabled_msg msg;
+	struct confdata base;
+	struct sigaction sa;
+	struct pollfd pfd;
+	struct out *o;
+	const char *errstr;
+	uint64_t now, deadline, next;
+	uint32_t ttl;
+	char *address = "127.0.0.1";
+	int ch, i, n, s, timeout;
+	int daemonize = 0, port = RELAY_PORT, window = 100;
+
+	conf_init(&base);
+	base.macs = (1 << MAC_MAX) - 1;
+
+	while ((ch = getopt(argc, argv, "a:dk:K:m:p:r:vw:h")) != -1) {
+		switch (ch) {
+		case 'a':
+			address = optarg;
+			break;
+		case 'd':
+			daemonize = 1;
+			break;
+		case 'k':
+			use_key = 1;
+			if (conf_readkey(optarg, key) == -1)
+				err(1, "unable to read authentication key");
+			break;
+		case 'K':
+			base.use_key = 1;
+			if (conf_readkey(optarg, base.key) == -1)
+				err(1, "unable to read authentication key");
+			break;
+		case 'm':
+			if ((mac = mac_lookup(optarg)) == -1)
+				errx(1, "unknown MAC %s", optarg);
+			break;
+		case 'p':
+			port = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			if ((maxtries = strtol(optarg, NULL, 10)) < 1)
+				usage(1);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'w':
+			if ((window = strtol(optarg, NULL, 10)) < 1)
+				usage(1);
+			break;
+		case 'h':
+		default:
+			usage(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
+		usage(1);
+
+	for (; argc > 0; argc--, argv++)
+		adddest(*argv);
+
+	if ((conf = conf_build(&base, NULL, &errstr)) == NULL)
+		errx(1, "%s", errstr);
+
+	memset(&laddr, 0, sizeof(laddr));
+	laddr.sin_family = AF_INET;
+	laddr.sin_addr.s_addr = inet_addr(address);
+	laddr.sin_port = htons(port);
+
+	if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+		err(1, "socket");
+	if (bind(s, (struct sockaddr *)&laddr, sizeof(laddr)) == -1)
+		err(1, "bind");
+
+	if (daemonize) {
+		tzset();
+
+		openlog("pftabled-relay", LOG_PID|LOG_NDELAY, LOG_DAEMON);
+		use_syslog = 1;
+
+		if (daemon(0, 0) == -1)
+			err(1, "daemon");
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = sigusr1;
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+		err(1, "sigaction");
+	sa.sa_handler = sigterm;
+	if (sigaction(SIGTERM, &sa, NULL) == -1 ||
+	    sigaction(SIGINT, &sa, NULL) == -1)
+		err(1, "sigaction");
+
+	pfd.fd = s;
+	pfd.events = POLLIN;
+	deadline = 0;
+
+	while (!want_quit) {
+		/* Sleep until the window ends or a retry is due */
+		now = nsec();
+		next = ndirty > 0 ? deadline : now + 1000 * MSEC;
+		for (i = 0; i < ndests; i++) {
+			o = &dests[i].queue[dests[i].head];
+			if (dests[i].len > 0 && o->next < next)
+				next = o->next;
+		}
+		timeout = next > now ? (next - now + MSEC - 1) / MSEC : 0;
+
+		if (poll(&pfd, 1, timeout) > 0) {
+			fromlen = sizeof(from);
+			n = recvfrom(s, &pkt, sizeof(pkt), 0,
+			    (struct sockaddr *)&from, &fromlen);
+			now = nsec();
+
+			if (n >= 0) {
+				received++;
+				if ((ch = msg_check(&pkt, n, time(NULL))) !=
+				    MSG_OK || (ch = msg_auth(conf, &pkt, n)) !=
+				    MSG_OK) {
+					rejected++;
+					if (verbose)
+						logit(LOG_ERR, "%s from %s\n",
+						    msg_errors[ch],
+						    inet_ntoa(from.sin_addr));
+				} else {
+					if (ndirty == 0)
+						deadline = now + window * MSEC;
+					for (i = 0; i < msg_count(&pkt); i++) {
+						msg_entry(&pkt, i, &msg, &ttl);
+						relay(&msg, ttl, &from, now);
+					}
+				}
+			}
+		} else
+			now = nsec();
+
+		if (ndirty > 0 && now >= deadline)
+			seal_all();
+
+		for (i = 0; i < ndests; i++)
+			flush_dest(&dests[i], now);
+
+		if (want_stats) {
+			want_stats = 0;
+			log_stats();
+		}
+	}
+
+	/* Forward what is left, once */
+	seal_all();
+	now = nsec();
+	for (i = 0; i < ndests; i++)
+		flush_dest(&dests[i], now);
+	log_stats();
+
+	return (0);
+}
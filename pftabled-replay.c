@@ -0,0 +1,448 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Feed a capture file recorded with pftabled -w through the message
+ * processing of the daemon against a backend which only counts, and
+ * report throughput and time spent per stage. The receive time of each
+ * record is used as the current time, so old captures still pass the
+ * timestamp check.
+ *
+ * With -j the records are read into memory first and split between
+ * receive workers, which run check and auth as in the daemon, so the
+ * scaling of the daemon with -j can be measured.
+ */
+
+#include "pftabled.h"
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define STAGE_CHECK	0
+#define STAGE_AUTH	1
+#define STAGE_TABLE	2
+#define STAGE_DISPATCH	3
+#define STAGE_EXPIRE	4
+#define STAGE_MAX	5
+
+static const char *stages[STAGE_MAX] = {
+	"check", "auth", "table", "dispatch", "expire"
+};
+
+static struct conf *conf;
+static time_t now;
+static int verbose = 0;
+
+static uint64_t nadd, ndel, nflush, nexpired, duplicates;
+static uint64_t stagecalls[STAGE_MAX], stagens[STAGE_MAX];
+static uint64_t results[MSG_MAX];
+
+/* Records loaded for -j, their datagrams stored back to back in data */
+struct loaded {
+	struct capture_rec	rec;
+	size_t			off;
+};
+static struct loaded *loaded;
+static size_t nloaded;
+static char *data;
+static int nworkers = 0;
+
+static void
+stub_add(int tid, struct in_addr *ip, uint8_t mask, uint32_t ttl)
+{
+	nadd++;
+	if (ttl && tmo_add(tid, ip, mask, ttl, now) == -1)
+		err(1, "tmo_add");
+}
+
+static void
+stub_del(int tid, struct in_addr *ip, uint8_t mask)
+{
+	ndel++;
+}
+
+static void
+stub_flush(int tid)
+{
+	nflush++;
+}
+
+static const struct backend stub = { stub_add, stub_del, stub_flush };
+
+static uint64_t
+nsec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+#define STAGE(stage, expr) do {					\
+	uint64_t t0 = nsec();					\
+	expr;							\
+	stagens[stage] += nsec() - t0;				\
+	stagecalls[stage]++;					\
+} while (0)
+
+static void
+expire(void)
+{
+	struct tmo *t;
+
+	while ((t = tmo_first()) != NULL && now >= (time_t)t->expire) {
+		nexpired++;
+		tmo_pop();
+	}
+}
+
+/* Sleep until the record received at offset off is due at speed */
+static void
+pace(uint64_t start, uint64_t off, double speed)
+{
+	struct timespec ts;
+	uint64_t due, cur;
+
+	due = start + (uint64_t)(off / speed);
+	if ((cur = nsec()) >= due)
+		return;
+
+	ts.tv_sec = (due - cur) / 1000000000ULL;
+	ts.tv_nsec = (due - cur) % 1000000000ULL;
+	nanosleep(&ts, NULL);
+}
+
+/* Worker source: every nworkers-th loaded record, starting at the id */
+static int
+wsource(struct worker *w, union pftabled_pkt *pkt, struct sockaddr_in *from,
+    time_t *t)
+{
+	size_t i = (size_t)w->arg;
+
+	if (i >= nloaded)
+		return (WORKER_DONE);
+	w->arg = (void *)(i + nworkers);
+
+	memcpy(pkt, data + loaded[i].off, loaded[i].rec.len);
+	from->sin_addr = loaded[i].rec.addr;
+	from->sin_port = loaded[i].rec.port;
+	*t = loaded[i].rec.sec;
+
+	return (loaded[i].rec.len);
+}
+
+static void
+wreject(int r, struct item *it)
+{
+	__atomic_add_fetch(&results[r], 1, __ATOMIC_RELAXED);
+}
+
+static void
+load(FILE *f)
+{
+	union pftabled_pkt pkt;
+	struct loaded *p;
+	size_t size = 0, datasize = 0, datalen = 0;
+	void *q;
+	int r;
+
+	for (;;) {
+		if (nloaded == size) {
+			size = size ? size * 2 : 65536;
+			if ((q = realloc(loaded, size * sizeof(*p))) == NULL)
+				err(1, "realloc");
+			loaded = q;
+		}
+		p = &loaded[nloaded];
+		if ((r = capture_read(f, &p->rec, &pkt, sizeof(pkt))) != 1)
+			break;
+
+		if (datalen + p->rec.len > datasize) {
+			datasize = datasize ? datasize * 2 : 1 << 20;
+			if ((q = realloc(data, datasize)) == NULL)
+				err(1, "realloc");
+			data = q;
+		}
+		memcpy(data + datalen, &pkt, p->rec.len);
+		p->off = datalen;
+		datalen += p->rec.len;
+		nloaded++;
+	}
+	if (r == -1)
+		errx(1, "truncated capture file");
+}
+
+/*
+ * Run one command from from through the session, table and dispatch
+ * stages as the daemon does. Returns -1 if it belongs to a batch
+ * applied before, else its result.
+ */
+static int
+command(struct sockaddr_in *from, struct ackreq *a, struct pftabled_msg *msg,
+    uint32_t ttl)
+{
+	struct pftabled_ack ack;
+	int r, tid;
+
+	if (msg_seen(from, a, now)) {
+		if (msg_applied(conf, from, a, now, &ack))
+			duplicates++;
+		return (-1);
+	}
+
+	STAGE(STAGE_TABLE, r = msg_table(conf, msg, &tid));
+	if (r == MSG_OK)
+		STAGE(STAGE_DISPATCH,
+		    r = msg_dispatch(conf, &stub, tid, msg, ttl));
+	results[r]++;
+	msg_applied(conf, from, a, now, &ack);
+
+	return (r);
+}
+
+/* Run the loaded records through nworkers workers */
+static uint64_t
+run_workers(void)
+{
+	struct worker *w;
+	struct item it;
+	uint64_t dropped = 0;
+	int i;
+
+	if ((w = workers_init(nworkers, WORKER_WAIT | WORKER_TIME)) == NULL)
+		err(1, "workers_init");
+	for (i = 0; i < nworkers; i++)
+		w[i].arg = (void *)(size_t)i;
+
+	if (workers_start(conf, wsource, wreject) == -1)
+		err(1, "workers_start");
+
+	while (!workers_done()) {
+		if (!workers_pop(&it, 100))
+			continue;
+		now = it.received;
+
+		if (tmo_first() != NULL)
+			STAGE(STAGE_EXPIRE, expire());
+
+		command(&it.from, &it.ack, &it.msg, it.ttl);
+	}
+
+	for (i = 0; i < nworkers; i++) {
+		pthread_join(w[i].thread, NULL);
+		dropped += w[i].dropped;
+		stagecalls[STAGE_CHECK] += w[i].checks;
+		stagens[STAGE_CHECK] += w[i].checkns;
+		stagecalls[STAGE_AUTH] += w[i].auths;
+		stagens[STAGE_AUTH] += w[i].authns;
+	}
+	if (dropped)
+		printf("dropped:  %llu, owner too slow\n",
+		    (unsigned long long)dropped);
+
+	return (nloaded);
+}
+
+static void
+report(struct capture_rec *rec, int r)
+{
+	printf("%u.%09u %s:%u %s\n", rec->sec, rec->nsec,
+	    inet_ntoa(rec->addr), ntohs(rec->port),
+	    r == -1 ? "batch applied before" : msg_errors[r]);
+}
+
+static void
+usage(int code)
+{
+	fprintf(stderr,
+	    "Usage: pftabled-replay [options...] capture [table ...]\n"
+	    "-c file     Read configuration file\n"
+	    "-f table    Force requests to use this table\n"
+	    "-j workers  Verify in this many threads, at maximum speed\n"
+	    "-k keyfile  Read authentication key from file\n"
+	    "-s speed    Replay speed factor, 0 for maximum (default: 1)\n"
+	    "-t timeout  Queue added IPs for timeout seconds\n"
+	    "-v          Print the result of every record\n");
+	if (code)
+		exit(code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	union pftabled_pkt pkt;
+	struct pftabled_msg msg;
+	uint32_t ttl;
+	struct capture_rec rec;
+	struct sockaddr_in from;
+	struct ackreq ack;
+	struct confdata base, file;
+	const char *errstr;
+	char errbuf[256];
+	uint64_t first = 0, start, elapsed, records = 0;
+	double speed = 1.0;
+	char *confpath = NULL;
+	FILE *f;
+	int ch, i, j, n, r;
+
+	conf_init(&base);
+
+	while ((ch = getopt(argc, argv, "c:f:j:k:s:t:vh")) != -1) {
+		switch (ch) {
+		case 'c':
+			confpath = optarg;
+			break;
+		case 'f':
+			if (strlen(optarg) >= PF_TABLE_NAME_SIZE)
+				errx(1, "table name too long");
+			strncpy(base.force, optarg, sizeof(base.force) - 1);
+			break;
+		case 'j':
+			nworkers = strtol(optarg, NULL, 10);
+			if (nworkers < 0 || nworkers > WORKER_MAX)
+				errx(1, "workers must be between 0 and %d",
+				    WORKER_MAX);
+			break;
+		case 'k':
+			base.use_key = 1;
+			if (conf_readkey(optarg, base.key) == -1)
+				err(1, "unable to read authentication key");
+			break;
+		case 's':
+			speed = strtod(optarg, NULL);
+			if (speed < 0)
+				usage(1);
+			break;
+		case 't':
+			base.timeout = strtol(optarg, NULL, 10);
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 'h':
+		default:
+			usage(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
+		usage(1);
+
+	if ((f = fopen(*argv, "r")) == NULL)
+		err(1, "%s", *argv);
+	if (capture_check(f) == -1)
+		errx(1, "%s: not a capture file", *argv);
+
+	for (argc--, argv++; argc > 0; argc--, argv++)
+		if (conf_addtable(&base, *argv) == -1)
+			errx(1, "invalid table name %s", *argv);
+
+	if (confpath &&
+	    conf_parse(confpath, &file, errbuf, sizeof(errbuf)) == -1)
+		errx(1, "%s", errbuf);
+	if ((conf = conf_build(&base, confpath ? &file : NULL,
+	    &errstr)) == NULL)
+		errx(1, "%s", errstr);
+
+	if (nworkers) {
+		load(f);
+		start = nsec();
+		records = run_workers();
+		goto done;
+	}
+
+	start = nsec();
+	memset(&from, 0, sizeof(from));
+	from.sin_family = AF_INET;
+
+	while ((r = capture_read(f, &rec, &pkt, sizeof(pkt))) == 1) {
+		uint64_t t = (uint64_t)rec.sec * 1000000000ULL + rec.nsec;
+
+		if (records++ == 0)
+			first = t;
+		if (speed > 0 && t > first)
+			pace(start, t - first, speed);
+		now = rec.sec;
+
+		if (tmo_first() != NULL)
+			STAGE(STAGE_EXPIRE, expire());
+
+		STAGE(STAGE_CHECK, r = msg_check(&pkt, rec.len, now));
+		if (r == MSG_OK)
+			STAGE(STAGE_AUTH, r = msg_auth(conf, &pkt, rec.len));
+		if (r != MSG_OK) {
+			results[r]++;
+			if (verbose)
+				report(&rec, r);
+			continue;
+		}
+
+		from.sin_addr = rec.addr;
+		from.sin_port = rec.port;
+		msg_ackreq(&pkt, &ack);
+		for (j = 0, n = msg_count(&pkt); j < n; j++) {
+			msg_entry(&pkt, j, &msg, &ttl);
+			ack.last = j == n - 1;
+			r = command(&from, &ack, &msg, ttl);
+			if (verbose)
+				report(&rec, r);
+		}
+	}
+	if (r == -1)
+		errx(1, "truncated capture file");
+
+done:
+	elapsed = nsec() - start;
+
+	printf("records:  %llu in %.3f s, %.0f records/s\n",
+	    (unsigned long long)records, elapsed / 1e9,
+	    elapsed ? records / (elapsed / 1e9) : 0);
+	printf("commands: %llu add, %llu del, %llu flush, %llu expired\n",
+	    (unsigned long long)nadd, (unsigned long long)ndel,
+	    (unsigned long long)nflush, (unsigned long long)nexpired);
+	for (i = 0; i < MSG_MAX; i++)
+		if (results[i])
+			printf("result:   %llu %s\n",
+			    (unsigned long long)results[i], msg_errors[i]);
+	if (duplicates)
+		printf("duplicates: %llu batches applied before\n",
+		    (unsigned long long)duplicates);
+	for (i = 0; i < STAGE_MAX; i++)
+		if (stagecalls[i])
+			printf("stage:    %-8s %10llu calls %8.1f ns/call\n",
+			    stages[i], (unsigned long long)stagecalls[i],
+			    (double)stagens[i] / stagecalls[i]);
+
+	return (0);
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Show the snapshot file written by pftabled -s: counters, a summary of
+ * the tables with the most tracked addresses and the addresses expiring
+ * next.
+ */
+
+#include "pftabled.h"
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAIT_MAX 3000	/* Milliseconds to wait for a requested snapshot */
+
+struct tablesum {
+	int		id;
+	uint64_t	entries;
+	uint64_t	prefixes;	/* entries with a mask below 32 */
+	uint32_t	next;		/* first expiry */
+};
+
+static int
+tablesum_cmp(const void *a, const void *b)
+{
+	const struct tablesum *x = a, *y = b;
+
+	if (x->entries != y->entries)
+		return (x->entries < y->entries ? 1 : -1);
+	return (x->id - y->id);
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct snap_entry *x = a, *y = b;
+
+	if (x->expire != y->expire)
+		return (x->expire < y->expire ? -1 : 1);
+	return (0);
+}
+
+/* Print a lifetime column, - for 0 */
+static void
+seconds(uint32_t ttl)
+{
+	if (ttl)
+		printf(" %6us", ttl);
+	else
+		printf(" %7s", "-");
+}
+
+static void
+usage(int code)
+{
+	fprintf(stderr,
+	    "Usage: pftabled-stat [options...] file\n"
+	    "-l          List the addresses expiring next\n"
+	    "-n count    Show this many tables and addresses (default: 10)\n"
+	    "-r          Request a new snapshot from pftabled first\n"
+	    "-t table    Only show this table\n");
+	if (code)
+		exit(code);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct snap *s;
+	struct snap_buf *sb;
+	struct snap_entry *e;
+	struct tablesum *ts;
+	struct counters *c;
+	struct snap_table *tab;
+	char *table = NULL;
+	uint64_t i, seq;
+	time_t now;
+	int ch, j, shown, list = 0, count = 10, request = 0, tid = -1;
+
+	while ((ch = getopt(argc, argv, "ln:rt:h")) != -1) {
+		switch (ch) {
+		case 'l':
+			list = 1;
+			break;
+		case 'n':
+			count = strtol(optarg, NULL, 10);
+			break;
+		case 'r':
+			request = 1;
+			break;
+		case 't':
+			table = optarg;
+			break;
+		case 'h':
+		default:
+			usage(1);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		usage(1);
+
+	if ((s = snap_attach(*argv, request)) == NULL)
+		err(1, "%s", *argv);
+
+	if (request) {
+		seq = snap_seq(s);
+		snap_request(s);
+		for (j = 0; j < WAIT_MAX / 10 && snap_seq(s) == seq; j++)
+			usleep(10000);
+		if (snap_seq(s) == seq)
+			warnx("no new snapshot, is pftabled running?");
+	}
+
+	if ((sb = snap_read(s)) == NULL) {
+		if (errno == EAGAIN)
+			errx(1, "no snapshot available");
+		err(1, "%s", *argv);
+	}
+
+	tab = (struct snap_table *)(sb + 1);
+	e = (struct snap_entry *)(tab + sb->ntables);
+	c = &sb->counters;
+	now = time(NULL);
+
+	if (table != NULL) {
+		for (j = 0; j < (int)sb->ntables; j++)
+			if (!strncmp(tab[j].name, table, PF_TABLE_NAME_SIZE))
+				tid = j;
+		if (tid == -1)
+			errx(1, "no such table %s", table);
+	}
+
+	printf("snapshot: taken %lld s ago, pid %u, up %lld s\n",
+	    (long long)(now - sb->taken), sb->pid,
+	    (long long)(sb->taken - sb->started));
+	printf("entries:  %llu\n", (unsigned long long)sb->nentries);
+	printf("commands: %llu add, %llu del, %llu flush, %llu expired, "
+	    "%llu requeued\n",
+	    (unsigned long long)c->added, (unsigned long long)c->deleted,
+	    (unsigned long long)c->flushed, (unsigned long long)c->expired,
+	    (unsigned long long)c->requeued);
+	for (j = 0; j < MSG_MAX; j++)
+		if (c->results[j])
+			printf("result:   %llu %s\n",
+			    (unsigned long long)c->results[j], msg_errors[j]);
+	if (c->acked)
+		printf("acked:    %llu acknowledgements, %llu duplicates\n",
+		    (unsigned long long)c->acked,
+		    (unsigned long long)c->duplicates);
+	if (c->dropped)
+		printf("dropped:  %llu by workers\n",
+		    (unsigned long long)c->dropped);
+
+	/* Per table summary, largest first */
+	if ((ts = calloc(sb->ntables + 1, sizeof(*ts))) == NULL)
+		err(1, "calloc");
+	for (j = 0; j < (int)sb->ntables; j++)
+		ts[j].id = j;
+	for (i = 0; i < sb->nentries; i++) {
+		if (e[i].table >= sb->ntables)
+			continue;
+		if (ts[e[i].table].entries++ == 0 ||
+		    e[i].expire < ts[e[i].table].next)
+			ts[e[i].table].next = e[i].expire;
+		if (e[i].mask < 32)
+			ts[e[i].table].prefixes++;
+	}
+	qsort(ts, sb->ntables, sizeof(*ts), tablesum_cmp);
+
+	printf("\n%-32s %9s %9s %8s %7s %7s\n", "table", "entries",
+	    "prefixes", "next", "ttl", "max");
+	for (j = 0, shown = 0; j < (int)sb->ntables && shown < count; j++) {
+		if (tid != -1 && ts[j].id != tid)
+			continue;
+		if (ts[j].entries == 0 && tid == -1)
+			break;
+		shown++;
+		printf("%-32.32s %9llu %9llu", tab[ts[j].id].name,
+		    (unsigned long long)ts[j].entries,
+		    (unsigned long long)ts[j].prefixes);
+		if (ts[j].entries)
+			printf(" %7llds", (long long)ts[j].next - now);
+		else
+			printf(" %8s", "-");
+		seconds(tab[ts[j].id].ttldef);
+		seconds(tab[ts[j].id].ttlmax);
+		printf("\n");
+	}
+
+	if (!list)
+		return (0);
+
+	/* Entries are in order of expiry per lifetime only */
+	qsort(e, sb->nentries, sizeof(*e), entry_cmp);
+	printf("\n%-32s %-18s %10s %10s\n", "table", "address", "age",
+	    "expires");
+	for (i = 0, shown = 0; i < sb->nentries && shown < count; i++) {
+		if (tid != -1 && e[i].table != tid)
+			continue;
+		if (e[i].table >= sb->ntables)
+			continue;
+		printf("%-32.32s %15s/%-2u %9llds %9llds\n",
+		    tab[e[i].table].name, inet_ntoa(e[i].addr), e[i].mask,
+		    (long long)now - e[i].added,
+		    (long long)e[i].expire - now);
+		shown++;
+	}
+
+	return (0);
+}
@@ -29,7 +29,6 @@
 
 #include <sys/ioctl.h>
 #include <sys/socket.h>
-#include <sys/queue.h>
 
 #include <net/if.h>
 #include <net/pfvar.h>
@@ -38,7 +37,9 @@
 #include <err.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pwd.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -51,16 +52,87 @@
 int pfdev = -1;
 
 int use_syslog = 0;
-int timeout = 0;
-
-TAILQ_HEAD(pftimeout_head, pftimeout) timeouts;
-struct pftimeout {
-	TAILQ_ENTRY(pftimeout)	queue;
-	struct in_addr		ip;
-	uint8_t			mask;
-	time_t			timeout;
-	char			table[PF_TABLE_NAME_SIZE];
+int verbose = 0;
+
+struct conf *conf;	/* Current configuration */
+int conffd = -1;	/* Socket to the parent reading the config file */
+FILE *capture = NULL;	/* Record received datagrams (-w) */
+int capturing = 0;
+pthread_mutex_t capturemtx = PTHREAD_MUTEX_INITIALIZER;
+
+struct worker *workers = NULL;	/* Receive workers (-j) */
+int nworkers = 0;
+int acksock = -1;		/* Socket acknowledgements are sent from */
+
+struct snap *snap = NULL;	/* Snapshot file (-s) */
+time_t snaptaken = 0;
+struct snap_buf *snapbuf = NULL;	/* Snapshot being written */
+struct snap_entry *snapfirst, *snapnext;
+uint64_t snapmax;		/* Entries snapbuf has room for */
+struct tmo_scan snapscan;
+time_t started;
+struct counters counters;
+
+#define SNAP_INTERVAL 10	/* Seconds between unrequested snapshots */
+#define SNAP_MIN 1		/* Seconds between requested snapshots */
+#define SNAP_STEP 65536		/* Entries written per loop iteration */
+
+/*
+ * Workers get a socket each if the system balances datagrams between
+ * sockets bound to the same port, otherwise they share one.
+ */
+#if defined(SO_REUSEPORT_LB)
+#define REUSEPORT SO_REUSEPORT_LB
+#elif defined(__linux__)
+#define REUSEPORT SO_REUSEPORT
+#endif
+
+volatile sig_atomic_t want_stats = 0;
+volatile sig_atomic_t want_reload = 0;
+
+/* Prebuilt ioctl argument per interned table, see pfio() */
+struct pfioc_table *pfios[TABLE_MAX];
+
+/*
+ * Addresses collected per table during one expiry pass, passed to pf
+ * with a single ioctl per table by batch_flush().
+ */
+#define EXPIRE_MAX 8192		/* Addresses deleted per pass */
+
+struct addrlist {
+	struct pfr_addr		*addrs;
+	int			 n;
+	int			 size;
+};
+
+struct batch {
+	unsigned long		 cmd;
+	struct addrlist		*lists[TABLE_MAX];
+	uint16_t		 dirty[TABLE_MAX];
+	int			 ndirty;
+};
+struct batch delbatch = { DIOCRDELADDRS };
+struct batch clrbatch = { DIOCRCLRASTATS };
+
+/* Idle expiry (-i): per table snapshot of the address statistics */
+#define IDLE_SCANMAX 4096	/* Due entries checked per pass */
+#define IDLE_RECHECK 5		/* Max age of statistics confirming idleness */
+#define IDLE_AGE(ttl) ((ttl) >= 8 ? (ttl) / 8 : 1) /* Max age otherwise */
+
+struct idlestats {
+	struct pfr_astats	*as;
+	int			 nas;
+	int			 asize;
+	time_t			 taken;
+};
+struct idlestats *idlestats[TABLE_MAX];
+
+/* Due entries found idle in possibly stale statistics, see expire() */
+struct idlecand {
+	struct tmo	t;
+	uint32_t	ttl;
 };
+struct idlecand idlecands[EXPIRE_MAX];
 
 static void
 logit(int level, const char *fmt, ...)
@@ -82,98 +154,673 @@ logit(int level, const char *fmt, ...)
 	va_end(ap);
 }
 
+/*
+ * Return the ioctl argument for table id with the table name already
+ * filled in. Built on first use and reused for every later request.
+ */
+static struct pfioc_table *
+pfio(int id)
+{
+	struct pfioc_table *io;
+
+	if ((io = pfios[id]) == NULL) {
+		if ((io = calloc(1, sizeof(*io))) == NULL)
+			err(1, "calloc");
+		memcpy(io->pfrio_table.pfrt_name, table_name(id),
+		    sizeof(io->pfrio_table.pfrt_name));
+		pfios[id] = io;
+	}
+
+	io->pfrio_buffer = NULL;
+	io->pfrio_esize = 0;
+	io->pfrio_size = 0;
+	io->pfrio_flags = 0;
+
+	return (io);
+}
+
 static void
-add(char *tname, struct in_addr *ip, uint8_t mask)
+add(int tid, struct in_addr *ip, uint8_t mask, uint32_t ttl)
 {
-	struct pfioc_table io;
-	struct pfr_table table;
+	struct pfioc_table *io;
 	struct pfr_addr addr;
-	struct pftimeout *t;
 
-	bzero(&io, sizeof io);
-	bzero(&table, sizeof(table));
 	bzero(&addr, sizeof(addr));
 
-	strncpy(table.pfrt_name, tname, sizeof(table.pfrt_name));
-
 	bcopy(ip, &addr.pfra_ip4addr, 4);
 	addr.pfra_af = AF_INET;
 	addr.pfra_net = mask;
 
-	io.pfrio_table = table;
-	io.pfrio_buffer = &addr;
-	io.pfrio_esize = sizeof(addr);
-	io.pfrio_size = 1;
+	io = pfio(tid);
+	io->pfrio_buffer = &addr;
+	io->pfrio_esize = sizeof(addr);
+	io->pfrio_size = 1;
 
-	if (ioctl(pfdev, DIOCRADDADDRS, &io))
+	if (ioctl(pfdev, DIOCRADDADDRS, io))
 		err(1, "ioctl");
+	counters.added++;
 
-	if (timeout) {
-		if ((t = malloc(sizeof(struct pftimeout))) == NULL)
-			err(1, "malloc");
-		t->ip = *ip;
-		t->mask = mask;
-		t->timeout = time(NULL) + timeout;
-		strncpy(t->table, tname, sizeof(t->table));
-		TAILQ_INSERT_HEAD(&timeouts, t, queue);
-	}
+	if (ttl && tmo_add(tid, ip, mask, ttl, time(NULL)) == -1)
+		err(1, "tmo_add");
 }
 
 static void
-del(char *tname, struct in_addr *ip, uint8_t mask)
+del(int tid, struct in_addr *ip, uint8_t mask)
 {
-	struct pfioc_table io;
-	struct pfr_table table;
+	struct pfioc_table *io;
 	struct pfr_addr addr;
 
-	bzero(&io, sizeof(io));
-	bzero(&table, sizeof(table));
 	bzero(&addr, sizeof(addr));
 
-	strncpy(table.pfrt_name, tname, sizeof(table.pfrt_name));
-
 	bcopy(ip, &addr.pfra_ip4addr, 4);
 	addr.pfra_af = AF_INET;
 	addr.pfra_net = mask;
 
-	io.pfrio_table = table;
-	io.pfrio_buffer = &addr;
-	io.pfrio_esize = sizeof(addr);
-	io.pfrio_size = 1;
+	io = pfio(tid);
+	io->pfrio_buffer = &addr;
+	io->pfrio_esize = sizeof(addr);
+	io->pfrio_size = 1;
 
-	if (ioctl(pfdev, DIOCRDELADDRS, &io))
+	if (ioctl(pfdev, DIOCRDELADDRS, io))
 		err(1, "ioctl");
+	counters.deleted++;
 }
 
 static void
-flush(char *tname)
+flush(int tid)
 {
-	struct pfioc_table io;
-	struct pfr_table table;
+	if (ioctl(pfdev, DIOCRCLRADDRS, pfio(tid)))
+		err(1, "ioctl");
+	counters.flushed++;
+}
+
+const struct backend pfbackend = { add, del, flush };
+
+static void
+logcmd(int tid, struct pftabled_msg *msg)
+{
+	switch (msg->cmd) {
+	case PFTABLED_CMD_ADD:
+		logit(LOG_INFO, "<%s> add %s/%d\n", table_name(tid),
+		    inet_ntoa(msg->addr), msg->mask);
+		break;
+	case PFTABLED_CMD_DEL:
+		logit(LOG_INFO, "<%s> del %s/%d\n", table_name(tid),
+		    inet_ntoa(msg->addr), msg->mask);
+		break;
+	case PFTABLED_CMD_FLUSH:
+		logit(LOG_INFO, "<%s> flush\n", table_name(tid));
+		break;
+	}
+}
 
-	bzero(&io, sizeof io);
-	bzero(&table, sizeof(table));
+/*
+ * Append a received datagram to the capture file. Flushed once a second
+ * so a capture of a busy daemon costs one write per second. Called with
+ * n == -1 to flush only.
+ */
+static void
+record(int n, struct sockaddr_in *from, void *buf, time_t now)
+{
+	static time_t flushed = 0;
+	struct timespec ts;
 
-	strncpy(table.pfrt_name, tname, sizeof(table.pfrt_name));
+	pthread_mutex_lock(&capturemtx);
+	if (capture == NULL)
+		goto done;
 
-	io.pfrio_table = table;
+	if (n >= 0) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		if (capture_write(capture, &ts, from, buf, n) == -1)
+			goto fail;
+	}
 
-	if (ioctl(pfdev, DIOCRCLRADDRS, &io))
-		err(1, "ioctl");
+	if (now != flushed) {
+		if (fflush(capture) == EOF)
+			goto fail;
+		flushed = now;
+	}
+	goto done;
+
+fail:
+	logit(LOG_ERR, "capture file: %s, capture stopped\n",
+	    strerror(errno));
+	fclose(capture);
+	capture = NULL;
+done:
+	pthread_mutex_unlock(&capturemtx);
+}
+
+static void
+logreject(int r, struct sockaddr_in *from)
+{
+	char buf[INET_ADDRSTRLEN];
+
+	if (r == MSG_CMD || (verbose && r != MSG_SHORT))
+		logit(LOG_ERR, "%s from %s\n", msg_errors[r],
+		    inet_ntop(AF_INET, &from->sin_addr, buf, sizeof(buf)));
+}
+
+/* Worker source: receive the next datagram on the worker's socket */
+static int
+wrecv(struct worker *w, union pftabled_pkt *pkt, struct sockaddr_in *from,
+    time_t *now)
+{
+	socklen_t len = sizeof(*from);
+	int n;
+
+	n = recvfrom(w->sock, pkt, sizeof(*pkt), 0, (struct sockaddr *)from,
+	    &len);
+	*now = time(NULL);
+
+	if (capturing)
+		record(n, from, pkt, *now);
+
+	return (n);
+}
+
+static void
+wreject(int r, struct item *it)
+{
+	__atomic_add_fetch(&counters.results[r], 1, __ATOMIC_RELAXED);
+	logreject(r, &it->from);
+}
+
+/* Send acknowledgement ack for the session of it */
+static void
+sendack(struct item *it, struct pftabled_ack *ack)
+{
+	char buf[INET_ADDRSTRLEN];
+
+	if (sendto(acksock, ack, sizeof(*ack), 0,
+	    (struct sockaddr *)&it->from, sizeof(it->from)) == -1) {
+		if (verbose)
+			logit(LOG_ERR, "acknowledgement to %s: %s\n",
+			    inet_ntop(AF_INET, &it->from.sin_addr, buf,
+			    sizeof(buf)), strerror(errno));
+		return;
+	}
+	counters.acked++;
+}
+
+/*
+ * Apply a single checked and authenticated command. Workers count their
+ * own rejects, which never are results counted here. Commands of a
+ * batch applied before are skipped and only acknowledged again.
+ */
+static void
+apply(struct item *it, time_t now)
+{
+	struct pftabled_ack ack;
+	int r, tid;
+
+	if (msg_seen(&it->from, &it->ack, now)) {
+		if (msg_applied(conf, &it->from, &it->ack, now, &ack)) {
+			counters.duplicates++;
+			sendack(it, &ack);
+		}
+		return;
+	}
+
+	if ((r = msg_table(conf, &it->msg, &tid)) == MSG_OK)
+		r = msg_dispatch(conf, &pfbackend, tid, &it->msg, it->ttl);
+	counters.results[r]++;
+
+	if (r == MSG_OK) {
+		if (verbose)
+			logcmd(tid, &it->msg);
+	} else
+		logreject(r, &it->from);
+
+	if (msg_applied(conf, &it->from, &it->ack, now, &ack))
+		sendack(it, &ack);
+}
+
+static void
+batch_add(struct batch *b, struct tmo *t)
+{
+	struct addrlist *l;
+	struct pfr_addr *a;
+	void *p;
+	int n;
+
+	if ((l = b->lists[t->table]) == NULL) {
+		if ((l = calloc(1, sizeof(*l))) == NULL)
+			err(1, "calloc");
+		b->lists[t->table] = l;
+	}
+
+	if (l->n == l->size) {
+		n = l->size ? l->size * 2 : 64;
+		if ((p = realloc(l->addrs, n * sizeof(*l->addrs))) == NULL)
+			err(1, "realloc");
+		l->addrs = p;
+		l->size = n;
+	}
+	if (l->n == 0)
+		b->dirty[b->ndirty++] = t->table;
+
+	a = &l->addrs[l->n++];
+	bzero(a, sizeof(*a));
+	bcopy(&t->ip, &a->pfra_ip4addr, 4);
+	a->pfra_af = AF_INET;
+	a->pfra_net = t->mask;
+}
+
+/* Run the ioctl of batch b once per table with addresses collected */
+static void
+batch_flush(struct batch *b)
+{
+	struct pfioc_table *io;
+	struct addrlist *l;
+	int tid;
+
+	while (b->ndirty > 0) {
+		tid = b->dirty[--b->ndirty];
+		l = b->lists[tid];
+		io = pfio(tid);
+		io->pfrio_buffer = l->addrs;
+		io->pfrio_esize = sizeof(struct pfr_addr);
+		io->pfrio_size = l->n;
+		if (ioctl(pfdev, b->cmd, io))
+			err(1, "ioctl");
+		l->n = 0;
+	}
+}
+
+static int
+astats_cmp(const void *a, const void *b)
+{
+	const struct pfr_addr *x = &((const struct pfr_astats *)a)->pfras_a;
+	const struct pfr_addr *y = &((const struct pfr_astats *)b)->pfras_a;
+	int r;
+
+	if ((r = memcmp(&x->pfra_ip4addr, &y->pfra_ip4addr, 4)) != 0)
+		return (r);
+	return (x->pfra_net - y->pfra_net);
+}
+
+/*
+ * Return the statistics snapshot of table tid, reading it again with a
+ * single ioctl if it is older than maxage seconds.
+ */
+static struct idlestats *
+idle_stats(int tid, uint32_t maxage, time_t now)
+{
+	struct pfioc_table *io;
+	struct idlestats *is;
+	void *p;
+	int i, n;
+
+	if ((is = idlestats[tid]) == NULL) {
+		if ((is = calloc(1, sizeof(*is))) == NULL)
+			err(1, "calloc");
+		is->taken = -1;
+		idlestats[tid] = is;
+	}
+
+	if (is->taken != -1 && now - is->taken < maxage)
+		return (is);
+
+	for (;;) {
+		io = pfio(tid);
+		io->pfrio_buffer = is->as;
+		io->pfrio_esize = sizeof(struct pfr_astats);
+		io->pfrio_size = is->asize;
+		if (ioctl(pfdev, DIOCRGETASTATS, io))
+			err(1, "ioctl");
+		if (io->pfrio_size <= is->asize)
+			break;
+		n = io->pfrio_size + io->pfrio_size / 4;
+		if ((p = realloc(is->as, n * sizeof(*is->as))) == NULL)
+			err(1, "realloc");
+		is->as = p;
+		is->asize = n;
+	}
+
+	/* Keep IPv4 entries only, sorted for lookup */
+	for (i = n = 0; i < io->pfrio_size; i++)
+		if (is->as[i].pfras_a.pfra_af == AF_INET)
+			is->as[n++] = is->as[i];
+	qsort(is->as, n, sizeof(*is->as), astats_cmp);
+	is->nas = n;
+	is->taken = now;
+
+	return (is);
+}
+
+/*
+ * Check whether the address of a due entry matched any packets since its
+ * counters were last cleared, in statistics at most maxage seconds old.
+ * If so, its counters are queued for clearing and 1 is returned.
+ */
+static int
+idle_active(struct tmo *t, uint32_t maxage, time_t now)
+{
+	struct idlestats *is;
+	struct pfr_astats key, *as;
+	uint64_t packets = 0;
+	int dir, op;
+
+	is = idle_stats(t->table, maxage, now);
+
+	bzero(&key, sizeof(key));
+	bcopy(&t->ip, &key.pfras_a.pfra_ip4addr, 4);
+	key.pfras_a.pfra_net = t->mask;
+	as = bsearch(&key, is->as, is->nas, sizeof(*is->as), astats_cmp);
+	if (as == NULL)
+		return (0);
+
+	for (dir = 0; dir < PFR_DIR_MAX; dir++)
+		for (op = 0; op < PFR_OP_ADDR_MAX; op++)
+			packets += as->pfras_packets[dir][op];
+	if (packets == 0)
+		return (0);
+
+	batch_add(&clrbatch, t);
+
+	return (1);
+}
+
+static void
+expire_entry(struct tmo *t)
+{
+	batch_add(&delbatch, t);
+	counters.expired++;
+	if (verbose)
+		logit(LOG_INFO, "<%s> timeout %s/%d\n",
+		    table_name(t->table), inet_ntoa(t->ip), t->mask);
+}
+
+static void
+requeued(struct tmo *t)
+{
+	counters.requeued++;
+	if (verbose)
+		logit(LOG_INFO, "<%s> active %s/%d\n", table_name(t->table),
+		    inet_ntoa(t->ip), t->mask);
+}
+
+/*
+ * Remove queued addresses whose timeout has passed, grouped into one
+ * delete per table. At most EXPIRE_MAX addresses are removed per call so
+ * a large wave of expiries does not hold up receiving for long; the rest
+ * follows on the next calls.
+ *
+ * With idle expiry the cached statistics may be up to an eighth of the
+ * lifetime old, so entries looking idle in them are only candidates.
+ * Before deleting, the statistics of their tables are read again if
+ * older than IDLE_RECHECK seconds, and candidates which matched packets
+ * meanwhile are queued again. Reading a table costs O(table), so it is
+ * not done on every pass.
+ */
+static void
+expire(time_t now)
+{
+	struct idlecand *c;
+	struct tmo *t, a;
+	uint32_t age;
+	int i, scanned = 0, n = 0;
+
+	while ((t = tmo_first()) != NULL) {
+		if (now < (time_t)t->expire || n == EXPIRE_MAX)
+			break;
+
+		if (!conf->idle) {
+			expire_entry(t);
+			n++;
+			tmo_pop();
+			continue;
+		}
+
+		/* Requeue addresses which are still in use */
+		if (++scanned > IDLE_SCANMAX)
+			break;
+		if (idle_active(t, IDLE_AGE(tmo_ttl()), now)) {
+			a = *t;
+			tmo_requeue(now);
+			requeued(&a);
+			continue;
+		}
+		idlecands[n].t = *t;
+		idlecands[n++].ttl = tmo_ttl();
+		tmo_pop();
+	}
+
+	if (conf->idle) {
+		for (i = 0; i < n; i++) {
+			c = &idlecands[i];
+			if ((age = IDLE_AGE(c->ttl)) > IDLE_RECHECK)
+				age = IDLE_RECHECK;
+			if (idle_active(&c->t, age, now) &&
+			    tmo_add(c->t.table, &c->t.ip, c->t.mask, c->ttl,
+			    now) == 0)
+				requeued(&c->t);
+			else
+				expire_entry(&c->t);
+		}
+	}
+
+	batch_flush(&delbatch);
+	batch_flush(&clrbatch);
+}
+
+/* Store queue entry t in the snapshot entry *arg points to */
+static void
+snapshot_entry(struct tmo *t, uint32_t ttl, void *arg)
+{
+	struct snap_entry **ep = arg, *e = (*ep)++;
+
+	e->addr = t->ip;
+	e->added = t->expire - ttl;
+	e->expire = t->expire;
+	e->table = t->table;
+	e->mask = t->mask;
+	e->reserved = 0;
+}
+
+/*
+ * Publish tracked entries and counters to the snapshot file when a
+ * reader asked for it, at most every SNAP_MIN seconds, otherwise every
+ * SNAP_INTERVAL seconds. Entries are written SNAP_STEP at a time, so a
+ * large queue is published over several loop iterations.
+ */
+static void
+snapshot(time_t now)
+{
+	struct tmo_stats st;
+	struct snap_table *tab;
+	uint64_t n;
+	int i, nt, done;
+
+	if (snapbuf == NULL) {
+		if (now - snaptaken < SNAP_MIN ||
+		    (!snap_requested(snap) && now - snaptaken < SNAP_INTERVAL))
+			return;
+		snaptaken = now;
+
+		/* Leave room for entries added while writing */
+		tmo_stats(&st);
+		nt = table_count();
+		snapmax = st.entries + st.entries / 8 + SNAP_STEP;
+		if ((snapbuf = snap_begin(snap, sizeof(*snapbuf) +
+		    nt * sizeof(*tab) + snapmax * sizeof(*snapnext))) == NULL) {
+			logit(LOG_ERR, "snapshot file: %s, snapshots "
+			    "stopped\n", strerror(errno));
+			snap = NULL;
+			return;
+		}
+
+		snapbuf->ntables = nt;
+		tab = (struct snap_table *)(snapbuf + 1);
+		for (i = 0; i < nt; i++) {
+			memcpy(tab[i].name, table_name(i), sizeof(tab[i].name));
+			tab[i].ttldef = conf->ttldef[i];
+			tab[i].ttlmax = conf->ttlmax[i];
+		}
+		snapfirst = snapnext = (struct snap_entry *)(tab + nt);
+		memset(&snapscan, 0, sizeof(snapscan));
+	}
+
+	n = snapmax - (uint64_t)(snapnext - snapfirst);
+	done = tmo_scan(&snapscan, n < SNAP_STEP ? n : SNAP_STEP,
+	    snapshot_entry, &snapnext);
+	n = snapnext - snapfirst;
+	if (!done && n < snapmax)
+		return;
+
+	snapbuf->taken = now;
+	snapbuf->started = started;
+	snapbuf->pid = getpid();
+	snapbuf->nentries = n;
+	snapbuf->counters.added = counters.added;
+	snapbuf->counters.deleted = counters.deleted;
+	snapbuf->counters.flushed = counters.flushed;
+	snapbuf->counters.expired = counters.expired;
+	snapbuf->counters.requeued = counters.requeued;
+	snapbuf->counters.acked = counters.acked;
+	snapbuf->counters.duplicates = counters.duplicates;
+	snapbuf->counters.dropped = 0;
+	for (i = 0; i < MSG_MAX; i++)
+		snapbuf->counters.results[i] =
+		    __atomic_load_n(&counters.results[i], __ATOMIC_RELAXED);
+	for (i = 0; i < nworkers; i++)
+		snapbuf->counters.dropped +=
+		    __atomic_load_n(&workers[i].dropped, __ATOMIC_RELAXED);
+
+	snap_commit(snap);
+	snapbuf = NULL;
+}
+
+static void
+sigusr1(int sig)
+{
+	want_stats = 1;
+}
+
+static void
+sighup(int sig)
+{
+	want_reload = 1;
+}
+
+/* Wake up once a second to expire addresses */
+static void
+settick(int s)
+{
+	struct timeval tv;
+
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+		err(1, "setsockopt");
+}
+
+/*
+ * Privileged parent: read the configuration file whenever the child asks
+ * for it and pass the parsed settings back. Exits with the child.
+ */
+static void
+confhelper(int fd, const char *path)
+{
+	struct confdata cd;
+	char errbuf[256];
+	char c;
+
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGUSR1, SIG_IGN);
+
+	while (read(fd, &c, 1) == 1) {
+		if (conf_parse(path, &cd, errbuf, sizeof(errbuf)) == -1) {
+			logit(LOG_ERR, "%s\n", errbuf);
+			if (conf_send(fd, NULL) == -1)
+				break;
+			continue;
+		}
+		if (conf_send(fd, &cd) == -1)
+			break;
+		conf_free(&cd);
+	}
+
+	exit(0);
+}
+
+/*
+ * Ask the parent for the current configuration file and switch to it.
+ * Queued timeouts are kept, the old configuration stays in effect if
+ * anything goes wrong.
+ */
+static void
+reload(struct confdata *base)
+{
+	struct confdata cd;
+	struct conf *c, *old;
+	const char *errstr;
+
+	if (conffd == -1) {
+		logit(LOG_ERR, "no configuration file to reload\n");
+		return;
+	}
+
+	if (write(conffd, "R", 1) != 1 || conf_recv(conffd, &cd) == -1) {
+		logit(LOG_ERR, "reload failed, keeping configuration\n");
+		return;
+	}
+
+	c = conf_build(base, &cd, &errstr);
+	conf_free(&cd);
+	if (c == NULL) {
+		logit(LOG_ERR, "reload failed: %s\n", errstr);
+		return;
+	}
+
+	old = conf;
+	conf = c;
+	workers_setconf(c, old);
+	logit(LOG_INFO, "configuration reloaded\n");
+}
+
+static void
+log_stats(void)
+{
+	struct tmo_stats st;
+	int i;
+
+	tmo_stats(&st);
+	logit(LOG_INFO, "%llu timeouts, %llu lifetimes, %llu bytes "
+	    "(%llu per entry)\n", (unsigned long long)st.entries,
+	    (unsigned long long)st.lanes, (unsigned long long)st.bytes,
+	    (unsigned long long)(st.entries ? st.bytes / st.entries : 0));
+	if (counters.acked)
+		logit(LOG_INFO, "%llu acknowledgements, %llu duplicates\n",
+		    (unsigned long long)counters.acked,
+		    (unsigned long long)counters.duplicates);
+
+	for (i = 0; i < nworkers; i++)
+		logit(LOG_INFO, "worker %d: %llu accepted, %llu dropped\n", i,
+		    (unsigned long long)__atomic_load_n(&workers[i].received,
+		    __ATOMIC_RELAXED),
+		    (unsigned long long)__atomic_load_n(&workers[i].dropped,
+		    __ATOMIC_RELAXED));
 }
 
 static void
 usage(int code)
 {
 	fprintf(stderr,
-	    "Usage: pftabled [options...]\n"
+	    "Usage: pftabled [options...] [table ...]\n"
 	    "-d          Run as daemon in the background\n"
 	    "-v          Log all received packets\n"
 	    "-a address  Bind to this address (default: 0.0.0.0)\n"
+	    "-c file     Read configuration file, again on SIGHUP\n"
 	    "-f table    Force requests to use this table\n"
+	    "-i          Expire IPs only after timeout seconds of inactivity\n"
+	    "-j workers  Receive and verify in this many threads\n"
 	    "-k keyfile  Read authentication key from file\n"
 	    "-p port     Bind to this port (default: 56789)\n"
-	    "-t timeout  Remove IPs from table after timeout seconds\n");
+	    "-s file     Publish tracked IPs and counters to snapshot file\n"
+	    "-t timeout  Remove IPs from table after timeout seconds\n"
+	    "-w file     Record all received datagrams to capture file\n");
 	if (code)
 		exit(code);
 }
@@ -182,87 +829,157 @@ int
 main(int argc, char *argv[])
 {
 	struct sockaddr_in laddr;
-	struct sockaddr_in raddr;
 	socklen_t socklen = sizeof(struct sockaddr_in);
 	struct passwd *pw;
-	struct pftabled_msg msg;
-	int ch, n, s;
-	struct timeval tv;
-	struct pftimeout *t;
-	char *table;
-	int keyfile;
+	union pftabled_pkt pkt;
+	struct item it;
+	struct confdata base, file;
+	struct sigaction sa;
+	const char *errstr;
+	char errbuf[256];
+	int ch, i, n, r, s, nsocks, one = 1;
+	int pair[2];
+	time_t now;
 
 	/* Options and their defaults */
 	char *address = NULL;
+	char *confpath = NULL;
+	char *capturepath = NULL;
+	char *snappath = NULL;
 	int daemonize = 0;
-	char *forced = NULL;
-	char key[SHA1_DIGEST_LENGTH];
-	int use_key = 0;
 	int port = 56789;
-	int verbose = 0;
+
+	conf_init(&base);
 
 	/* Process commandline arguments */
-	while ((ch = getopt(argc, argv, "a:df:k:p:t:vh")) != -1) {
+	while ((ch = getopt(argc, argv, "a:c:df:ij:k:p:s:t:vw:h")) != -1) {
 		switch (ch) {
 		case 'a':
 			address = optarg;
 			break;
+		case 'c':
+			if ((confpath = realpath(optarg, NULL)) == NULL)
+				err(1, "%s", optarg);
+			break;
 		case 'd':
 			daemonize = 1;
 			break;
 		case 'f':
-			forced = optarg;
-			if (strlen(forced) >= PF_TABLE_NAME_SIZE)
-				err(1, "table name too long");
+			if (strlen(optarg) >= PF_TABLE_NAME_SIZE)
+				errx(1, "table name too long");
+			strncpy(base.force, optarg, sizeof(base.force) - 1);
+			break;
+		case 'i':
+			base.idle = 1;
+			break;
+		case 'j':
+			nworkers = strtol(optarg, NULL, 10);
+			if (nworkers < 0 || nworkers > WORKER_MAX)
+				errx(1, "workers must be between 0 and %d",
+				    WORKER_MAX);
 			break;
 		case 'k':
-			use_key = 1;
-			keyfile = open(optarg, O_RDONLY, 0);
-			if (read(keyfile, key, sizeof(key)) != sizeof(key))
+			base.use_key = 1;
+			if (conf_readkey(optarg, base.key) == -1)
 				err(1, "unable to read authentication key");
-			close(keyfile);
 			break;
 		case 'p':
 			port = strtol(optarg, NULL, 10);
 			break;
+		case 's':
+			snappath = optarg;
+			break;
 		case 't':
-			timeout = strtol(optarg, NULL, 10);
-			TAILQ_INIT(&timeouts);
+			base.timeout = strtol(optarg, NULL, 10);
 			break;
 		case 'v':
 			verbose = 1;
 			break;
+		case 'w':
+			capturepath = optarg;
+			break;
 		case 'h':
 		default:
 			usage(1);
 		}
 	}
+	argc -= optind;
+	argv += optind;
+
+	/* Remaining arguments are the only tables clients may use */
+	for (; argc > 0; argc--, argv++)
+		if (conf_addtable(&base, *argv) == -1)
+			errx(1, "invalid table name %s", *argv);
+
+	/* Read configuration file while we can */
+	if (confpath &&
+	    conf_parse(confpath, &file, errbuf, sizeof(errbuf)) == -1)
+		errx(1, "%s", errbuf);
+
+	if ((conf = conf_build(&base, confpath ? &file : NULL,
+	    &errstr)) == NULL)
+		errx(1, "%s", errstr);
+	if (confpath)
+		conf_free(&file);
 
-	/* Prepare and bind our socket */
+	if (nworkers && (workers = workers_init(nworkers, 0)) == NULL)
+		err(1, "workers_init");
+
+	/* Prepare and bind our sockets, one per worker if possible */
 	bzero((char *)&laddr, sizeof(struct sockaddr_in));
 	laddr.sin_family = AF_INET;
 	laddr.sin_addr.s_addr = inet_addr(address ? address : "0.0.0.0");
 	laddr.sin_port = htons(port);
 
-	if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
-		err(1, "socket");
-
-	if (bind(s, (struct sockaddr *)&laddr, socklen) == -1)
-		err(1, "bind");
+	nsocks = 1;
+#ifdef REUSEPORT
+	if (nworkers > 1)
+		nsocks = nworkers;
+#endif
 
-	/* Set receive timeout on socket if using timeouts */
-	if (timeout) {
-		tv.tv_sec = 1;
-		tv.tv_usec = 0;
-		if (setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+	for (i = 0; i < nsocks; i++) {
+		if ((s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+			err(1, "socket");
+#ifdef REUSEPORT
+		if (nsocks > 1 && setsockopt(s, SOL_SOCKET, REUSEPORT,
+		    &one, sizeof(one)) == -1)
 			err(1, "setsockopt");
+#endif
+		if (bind(s, (struct sockaddr *)&laddr, socklen) == -1)
+			err(1, "bind");
+		if (nworkers)
+			workers[i].sock = s;
 	}
+	for (i = nsocks; i < nworkers; i++)
+		workers[i].sock = s;
+	acksock = s;
+
+	/*
+	 * Set receive timeout on sockets, as any client may add addresses
+	 * with a lifetime. Workers also need it to free replaced
+	 * configurations.
+	 */
+	if (nworkers)
+		for (i = 0; i < nsocks; i++)
+			settick(workers[i].sock);
+	else
+		settick(s);
 
 	/* Open PF device while we are root */
 	pfdev = open(PFDEV, O_RDWR);
 	if (pfdev == -1)
 		err(1, "open " PFDEV);
 
+	/* Open capture file outside the chroot */
+	if (capturepath && (capture = capture_open(capturepath)) == NULL)
+		err(1, "%s", capturepath);
+	capturing = capture != NULL;
+
+	/* Create snapshot file outside the chroot */
+	if (snappath && (snap = snap_create(snappath)) == NULL)
+		err(1, "%s", snappath);
+	started = time(NULL);
+
 	/* Daemonize if requested */
 	if (daemonize) {
 		tzset();
@@ -274,6 +991,28 @@ main(int argc, char *argv[])
 			err(1, "daemon");
 	}
 
+	/* Keep a privileged parent around to reread the config file */
+	if (confpath) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+			err(1, "socketpair");
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			close(pair[0]);
+			conffd = pair[1];
+			break;
+		default:
+			close(pair[1]);
+			for (i = 0; i < nsocks; i++)
+				close(nworkers ? workers[i].sock : s);
+			close(pfdev);
+			if (capture != NULL)
+				fclose(capture);
+			confhelper(pair[0], confpath);
+		}
+	}
+
 	/* Find less privileged user */
 	pw = getpwnam("pftabled");
 	if (!pw)
@@ -297,89 +1036,82 @@ main(int argc, char *argv[])
 		}
 	}
 
-	/* Main loop: receive packets */
-	for(;;) {
-		n = recvfrom(s, &msg, sizeof(msg), 0,
-		    (struct sockaddr *)&raddr, &socklen);
+	/*
+	 * Log timeout queue usage on SIGUSR1 and reload the configuration
+	 * on SIGHUP, both interrupting recvfrom
+	 */
+	bzero(&sa, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = sigusr1;
+	if (sigaction(SIGUSR1, &sa, NULL) == -1)
+		err(1, "sigaction");
+	sa.sa_handler = sighup;
+	if (sigaction(SIGHUP, &sa, NULL) == -1)
+		err(1, "sigaction");
+	signal(SIGPIPE, SIG_IGN);
 
-		/* Check for timeouts */
-		if (timeout) {
-			time_t now = time(NULL);
-
-			while (!TAILQ_EMPTY(&timeouts)) {
-				t = TAILQ_LAST(&timeouts, pftimeout_head);
-				if (now < t->timeout)
-					break;
-
-				del(t->table, &t->ip, t->mask);
-				if (verbose)
-					logit(LOG_INFO, "<%s> timeout %s/%d\n",
-					    t->table, inet_ntoa(t->ip),
-					    t->mask);
-
-				TAILQ_REMOVE(&timeouts, t, queue);
-				free(t);
-			}
+	if (nworkers && workers_start(conf, wrecv, wreject) == -1) {
+		logit(LOG_ERR, "unable to start workers: %s\n",
+		    strerror(errno));
+		exit(1);
+	}
+
+	/* Main loop: receive packets, or take them from the workers */
+	for(;;) {
+		if (nworkers) {
+			/* Do not wait while a snapshot is being written */
+			n = workers_pop(&it, snapbuf != NULL ? 0 : 1000);
+			now = time(NULL);
+			workers_reclaim();
+			if (capturing)
+				record(-1, NULL, NULL, now);
+		} else {
+			n = recvfrom(s, &pkt, sizeof(pkt),
+			    snapbuf != NULL ? MSG_DONTWAIT : 0,
+			    (struct sockaddr *)&it.from, &socklen);
+			now = time(NULL);
+			if (capturing)
+				record(n, &it.from, &pkt, now);
 		}
 
-		/* Drop short packets */
-		if (n != sizeof(msg))
-			continue;
+		if (want_stats) {
+			want_stats = 0;
+			log_stats();
+		}
 
-		/* Check packet version */
-		if (msg.version > PFTABLED_MSG_VERSION) {
-			if (verbose)
-				logit(LOG_ERR, "wrong protocol version\n");
-			continue;
+		if (want_reload) {
+			want_reload = 0;
+			reload(&base);
 		}
 
-		/* Transform packets from previous versions */
-		if (msg.version == 0x01)
-			msg.mask = 32;
+		/* Check for timeouts */
+		if (tmo_first() != NULL)
+			expire(now);
 
-		/* Check timestamp */
-		if (abs(time(NULL) - ntohl(msg.timestamp)) > CLOCKDIFF) {
-			if (verbose)
-				logit(LOG_ERR, "wrong timestamp from %s\n",
-				    inet_ntoa(raddr.sin_addr));
+		if (snap != NULL)
+			snapshot(now);
+
+		/* Workers already checked and authenticated the command */
+		if (nworkers) {
+			if (n)
+				apply(&it, now);
 			continue;
 		}
 
-		/* Check authentication */
-		if (use_key && hmac_verify(key, &msg,
-		    sizeof(msg) - sizeof(msg.digest), msg.digest)) {
-			if (verbose)
-				logit(LOG_ERR, "wrong authentication\n");
+		if (n == -1)
+			continue;
+		if ((r = msg_check(&pkt, n, now)) != MSG_OK ||
+		    (r = msg_auth(conf, &pkt, n)) != MSG_OK) {
+			counters.results[r]++;
+			logreject(r, &it.from);
 			continue;
 		}
 
-		/* Which table to use */
-		table = forced ? forced : (char *)&msg.table;
-
-		/* Dispatch commands */
-		switch (msg.cmd) {
-		case PFTABLED_CMD_ADD:
-			cleanmask(&msg.addr, msg.mask);
-			add(table, &msg.addr, msg.mask);
-			if (verbose)
-				logit(LOG_INFO, "<%s> add %s/%d\n", table,
-				    inet_ntoa(msg.addr), msg.mask);
-			break;
-		case PFTABLED_CMD_DEL:
-			cleanmask(&msg.addr, msg.mask);
-			del(table, &msg.addr, msg.mask);
-			if (verbose)
-				logit(LOG_INFO, "<%s> del %s/%d\n", table,
-				    inet_ntoa(msg.addr), msg.mask);
-			break;
-		case PFTABLED_CMD_FLUSH:
-			flush(table);
-			if (verbose)
-				logit(LOG_INFO, "<%s> flush\n", table);
-			break;
-		default:
-			logit(LOG_ERR, "received unknown command\n");
-			break;
+		msg_ackreq(&pkt, &it.ack);
+		for (i = 0, n = msg_count(&pkt); i < n; i++) {
+			msg_entry(&pkt, i, &it.msg, &it.ttl);
+			it.ack.last = i == n - 1;
+			apply(&it, now);
 		}
 	}
 
@@ -39,6 +39,9 @@
 #endif
 #endif
 #include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
 #include "sha1.h"
 
 #ifdef DEBUG
@@ -47,18 +50,26 @@
 #define DPRINTF(x)
 #endif
 
+/* A /0 is cleared whole, shifting by 32 is undefined */
 #define cleanmask(ip, mask) { \
 	uint8_t *b = (uint8_t *)ip; \
-	if (mask < 32) b[3] &= (0xFF << (32 - mask)); \
-	if (mask < 24) b[2] &= (0xFF << (24 - mask)); \
-	if (mask < 16) b[1] &= (0xFF << (16 - mask)); \
-	if (mask <  8) b[0] &= (0xFF << ( 8 - mask)); \
+	if (mask == 0) { \
+		b[0] = b[1] = b[2] = b[3] = 0; \
+	} else { \
+		if (mask < 32) b[3] &= (0xFFU << (32 - mask)); \
+		if (mask < 24) b[2] &= (0xFFU << (24 - mask)); \
+		if (mask < 16) b[1] &= (0xFFU << (16 - mask)); \
+		if (mask <  8) b[0] &= (0xFFU << ( 8 - mask)); \
+	} \
 }
 
 #ifndef PF_TABLE_NAME_SIZE
 #define PF_TABLE_NAME_SIZE 32	/* Needs to be defined for non-OpenBSD */
 #endif
 
+#define TABLE_MAX 1024	/* Maximum number of distinct tables the server
+			   will manage. */
+
 #define CLOCKDIFF 60	/* Maximum clock difference plus network delay in
 			   seconds between server and client. Server drops
 			   packet if exceeded. */
@@ -69,10 +80,22 @@
 #define PFTABLED_CMD_DEL   0x02
 #define PFTABLED_CMD_FLUSH 0x03
 
+/*
+ * Message authentication codes, selected by the reserved byte of a
+ * version 2 message or the mac field of a batch. Version 1 messages
+ * always use HMAC-SHA1.
+ */
+#define MAC_HMAC_SHA1	0
+#define MAC_BLAKE2S	1	/* keyed BLAKE2s, 20 byte output */
+#define MAC_SIPHASH	2	/* SipHash-2-4-128, first 16 key bytes */
+#define MAC_MAX		3
+
+#define MAC_DEFAULT	(1 << MAC_HMAC_SHA1 | 1 << MAC_BLAKE2S)
+
 struct pftabled_msg {
 	uint8_t		version;
 	uint8_t		cmd;
-	uint8_t		reserved;
+	uint8_t		reserved;	/* MAC_* in version 2 */
 	uint8_t		mask;
 	struct in_addr	addr;
 	char		table[PF_TABLE_NAME_SIZE];
@@ -80,7 +103,374 @@ struct pftabled_msg {
 	uint8_t		digest[SHA1_DIGEST_LENGTH];
 };
 
+/*
+ * Batch message: up to BATCH_MAX commands for one table in a datagram
+ * of PFTABLED_BATCH_LEN(count) bytes. The digest covers the whole
+ * datagram with the digest field set to zero.
+ */
+#define PFTABLED_BATCH_VERSION 0x03
+#define BATCH_MAX 64
+
+struct pftabled_entry {
+	uint8_t		cmd;
+	uint8_t		mask;
+	uint16_t	reserved;
+	struct in_addr	addr;
+	uint32_t	ttl;		/* seconds, 0 for the table default */
+};
+
+struct pftabled_batch {
+	uint8_t		version;
+	uint8_t		mac;		/* MAC_* */
+	uint16_t	count;
+	uint32_t	timestamp;
+	uint16_t	session;	/* acknowledge if not zero */
+	uint16_t	seq;
+	char		table[PF_TABLE_NAME_SIZE];
+	uint8_t		digest[SHA1_DIGEST_LENGTH];
+	struct pftabled_entry entries[BATCH_MAX];
+};
+
+#define PFTABLED_BATCH_LEN(n) (sizeof(struct pftabled_batch) - \
+	(BATCH_MAX - (n)) * sizeof(struct pftabled_entry))
+
+/*
+ * Acknowledgement of the batches of a session, sent back to the client
+ * once their commands were applied: the highest sequence number applied
+ * and which of the ACK_WINDOW numbers up to it were. The digest, with
+ * the MAC of the acknowledged batch, covers the datagram with the digest
+ * field set to zero. See ack.c.
+ */
+#define PFTABLED_ACK_VERSION 0x04
+#define ACK_WINDOW 32		/* Batches a client may have unacknowledged */
+
+struct pftabled_ack {
+	uint8_t		version;
+	uint8_t		mac;
+	uint16_t	session;
+	uint16_t	seq;
+	uint16_t	reserved;
+	uint32_t	applied;	/* bit i set if seq - i was applied */
+	uint8_t		digest[SHA1_DIGEST_LENGTH];
+};
+
+/* Any received datagram */
+union pftabled_pkt {
+	uint8_t			version;
+	struct pftabled_msg	msg;
+	struct pftabled_batch	batch;
+};
+
+/* Result of the processing stages in msg.c */
+#define MSG_OK		0
+#define MSG_SHORT	1
+#define MSG_VERSION	2
+#define MSG_TIMESTAMP	3
+#define MSG_AUTH	4
+#define MSG_TABLE	5
+#define MSG_CMD		6
+#define MSG_PROTECTED	7
+#define MSG_MAC		8
+#define MSG_MAX		9
+
+/* Operations on the tables, pf(4) in the daemon */
+struct backend {
+	void	(*add)(int, struct in_addr *, uint8_t, uint32_t);
+	void	(*del)(int, struct in_addr *, uint8_t);
+	void	(*flush)(int);
+};
+
+/* Receive workers, see worker.c */
+#define WORKER_MAX	64
+#define WORKER_DONE	-2
+#define WORKER_WAIT	0x01	/* Wait for room in the ring, never drop */
+#define WORKER_TIME	0x02	/* Time the check and auth stages */
+#define RING_SIZE	4096	/* Accepted messages queued per worker */
+#define CACHELINE	64	/* Bytes, to keep threads off each other's lines */
+
+/* Session of a batch to acknowledge, session 0 if none */
+struct ackreq {
+	uint16_t	session;
+	uint16_t	seq;
+	uint8_t		mac;
+	uint8_t		last;		/* last command of the batch */
+};
+
+struct item {
+	struct pftabled_msg	msg;
+	uint32_t		ttl;
+	struct sockaddr_in	from;
+	time_t			received;
+	struct ackreq		ack;
+};
+
+struct ring;
+
+struct worker {
+	pthread_t	 thread;
+	int		 id;
+	int		 sock;
+	void		*arg;
+	struct ring	*ring;
+	uint64_t	 epoch;		/* configuration epoch in use */
+	int		 done;
+	uint64_t	 received;	/* accepted messages */
+	uint64_t	 dropped;	/* accepted but ring was full */
+	uint64_t	 checks;	/* with WORKER_TIME */
+	uint64_t	 checkns;
+	uint64_t	 auths;
+	uint64_t	 authns;
+} __attribute__((aligned(CACHELINE)));	/* no false sharing */
+
+/* Capture file format, see capture.c */
+#define CAPTURE_MAGIC	0x70667463	/* "pftc" */
+#define CAPTURE_VERSION	1
+
+struct capture_hdr {
+	uint32_t	magic;
+	uint16_t	version;
+	uint16_t	reserved;
+};
+
+struct capture_rec {
+	uint32_t	sec;		/* receive time */
+	uint32_t	nsec;
+	struct in_addr	addr;		/* sender */
+	uint16_t	port;
+	uint16_t	len;		/* length of datagram that follows */
+};
+
+/*
+ * Snapshot file, see snapshot.c. Shared with readers on the same host,
+ * so all fields are in host byte order.
+ */
+#define SNAP_MAGIC	0x70667373	/* "pfss" */
+#define SNAP_VERSION	6
+
+struct snap_hdr {
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	seq;		/* last complete snapshot */
+	uint64_t	writing;	/* snapshot being written */
+	uint64_t	bufsize;	/* bytes per buffer */
+	uint64_t	requested;	/* bumped by readers */
+};
+
+/* Event counters of the daemon */
+struct counters {
+	uint64_t	results[MSG_MAX];	/* received datagrams */
+	uint64_t	added;
+	uint64_t	deleted;
+	uint64_t	flushed;
+	uint64_t	expired;
+	uint64_t	requeued;	/* found active by idle expiry */
+	uint64_t	dropped;	/* accepted by a worker, ring full */
+	uint64_t	acked;		/* acknowledgements sent */
+	uint64_t	duplicates;	/* batches applied before */
+};
+
+/*
+ * A snapshot: this header, ntables struct snap_table and nentries struct
+ * snap_entry, in order of expiry per lifetime only.
+ */
+struct snap_buf {
+	int64_t		taken;
+	int64_t		started;
+	uint32_t	pid;
+	uint32_t	ntables;
+	uint64_t	nentries;
+	struct counters	counters;
+};
+
+/* A table with its lifetimes, 0 keeps addresses or has no maximum */
+struct snap_table {
+	char		name[PF_TABLE_NAME_SIZE];
+	uint32_t	ttldef;
+	uint32_t	ttlmax;
+};
+
+struct snap_entry {
+	struct in_addr	addr;
+	uint32_t	added;
+	uint32_t	expire;
+	uint16_t	table;
+	uint8_t		mask;
+	uint8_t		reserved;
+};
+
+/*
+ * Timeout queue entry, see timeout.c. Kept at 16 bytes: it is the only
+ * per address state the server holds.
+ */
+struct tmo {
+	uint32_t	next;		/* index of next entry or TMO_NIL */
+	struct in_addr	ip;
+	uint32_t	expire;		/* seconds since the epoch */
+	uint16_t	table;		/* interned table id */
+	uint8_t		mask;
+	uint8_t		spare;
+};
+
+#define TMO_NIL 0xFFFFFFFFU
+
+#define PROTECT_MAX	1048576	/* Maximum number of protected prefixes */
+
+struct prefix {
+	struct in_addr	addr;
+	uint8_t		mask;
+	uint8_t		reserved[3];
+};
+
+struct protect;
+
+/*
+ * Settings from the command line or the configuration file. The file is
+ * parsed by the privileged parent and passed to the child, see conf.c.
+ */
+struct ttlconf {
+	char		table[PF_TABLE_NAME_SIZE];
+	uint32_t	def;		/* 0 to keep addresses */
+	uint32_t	max;		/* 0 for no limit */
+};
+
+struct confdata {
+	int		timeout;	/* -1 if not set */
+	int		idle;		/* -1 if not set */
+	int		macs;		/* 1 << MAC_*, -1 if not set */
+	int		use_key;
+	uint8_t		key[SHA1_DIGEST_LENGTH];
+	char		force[PF_TABLE_NAME_SIZE];
+	int		ntables;
+	char		(*tables)[PF_TABLE_NAME_SIZE];
+	int		nprotect;
+	struct prefix	*protect;
+	int		nttls;
+	struct ttlconf	*ttls;
+};
+
+/* Runtime configuration. Never modified, replaced as a whole on reload. */
+struct conf {
+	uint8_t		key[SHA1_DIGEST_LENGTH];
+	int		use_key;
+	int		forced;		/* table id or -1 */
+	int		restricted;	/* only tables in allowed[] */
+	int		timeout;
+	int		idle;
+	int		macs;		/* 1 << MAC_* accepted */
+	struct protect	*protect;	/* prefixes never added or NULL */
+	uint8_t		allowed[TABLE_MAX];
+	uint32_t	ttldef[TABLE_MAX];
+	uint32_t	ttlmax[TABLE_MAX];
+};
+
+struct tmo_stats {
+	uint64_t	entries;	/* entries in use */
+	uint64_t	lanes;		/* distinct lifetimes in use */
+	uint64_t	capacity;	/* entries allocated */
+	uint64_t	bytes;		/* memory held by the queue */
+};
+
+/* Position of a scan of the timeout queue, see tmo_scan() */
+struct tmo_scan {
+	uint32_t	lane;
+	uint32_t	entry;		/* next to visit */
+	uint64_t	seq;		/* number of entry within the lane */
+	uint64_t	end;		/* stop at this number, 0 if not begun */
+};
+
+/* ack.c */
+int ack_seen(struct sockaddr_in *, struct ackreq *, time_t);
+void ack_applied(struct conf *, struct sockaddr_in *, struct ackreq *,
+    time_t, struct pftabled_ack *);
+
 /* hmac.c */
 void hmac(uint8_t *, void *, int, uint8_t *);
 int hmac_verify(uint8_t *, void *, int, uint8_t *);
+extern const char *mac_names[MAC_MAX];
+int mac_lookup(const char *);
+void mac_sign(int, uint8_t *, void *, int, uint8_t *);
+int mac_verify(int, uint8_t *, void *, int, uint8_t *);
+
+/* blake2s.c */
+void blake2s(uint8_t *, size_t, const uint8_t *, size_t, const void *,
+    size_t);
+
+/* siphash.c */
+void siphash128(uint8_t *, const uint8_t *, const void *, size_t);
+
+/* capture.c */
+FILE *capture_open(const char *);
+int capture_write(FILE *, struct timespec *, struct sockaddr_in *, void *,
+    int);
+int capture_check(FILE *);
+int capture_read(FILE *, struct capture_rec *, void *, size_t);
+
+/* snapshot.c */
+struct snap;
+struct snap *snap_create(const char *);
+int snap_requested(struct snap *);
+struct snap_buf *snap_begin(struct snap *, size_t);
+void snap_commit(struct snap *);
+struct snap *snap_attach(const char *, int);
+void snap_request(struct snap *);
+uint64_t snap_seq(struct snap *);
+struct snap_buf *snap_read(struct snap *);
+
+/* conf.c */
+void conf_init(struct confdata *);
+void conf_free(struct confdata *);
+int conf_readkey(const char *, uint8_t *);
+int conf_addtable(struct confdata *, const char *);
+int conf_parse(const char *, struct confdata *, char *, size_t);
+int conf_send(int, struct confdata *);
+int conf_recv(int, struct confdata *);
+struct conf *conf_build(struct confdata *, struct confdata *, const char **);
+void conf_destroy(struct conf *);
+
+/* worker.c */
+struct worker *workers_init(int, int);
+int workers_start(struct conf *,
+    int (*)(struct worker *, union pftabled_pkt *, struct sockaddr_in *,
+    time_t *), void (*)(int, struct item *));
+int workers_pop(struct item *, int);
+int workers_done(void);
+struct conf *workers_conf(struct worker *);
+void workers_reclaim(void);
+void workers_setconf(struct conf *, struct conf *);
+
+/* msg.c */
+extern const char *msg_errors[MSG_MAX];
+int msg_check(union pftabled_pkt *, int, time_t);
+int msg_auth(struct conf *, union pftabled_pkt *, int);
+int msg_count(union pftabled_pkt *);
+void msg_entry(union pftabled_pkt *, int, struct pftabled_msg *,
+    uint32_t *);
+void msg_ackreq(union pftabled_pkt *, struct ackreq *);
+int msg_seen(struct sockaddr_in *, struct ackreq *, time_t);
+int msg_applied(struct conf *, struct sockaddr_in *, struct ackreq *,
+    time_t, struct pftabled_ack *);
+int msg_table(struct conf *, struct pftabled_msg *, int *);
+int msg_dispatch(struct conf *, const struct backend *, int,
+    struct pftabled_msg *, uint32_t);
+
+/* protect.c */
+struct protect *protect_build(struct prefix *, int);
+void protect_free(struct protect *);
+int protect_match(struct protect *, struct in_addr *, uint8_t);
+
+/* tables.c */
+int table_lookup(const char *);
+int table_intern(const char *);
+const char *table_name(int);
+int table_count(void);
+
+/* timeout.c */
+int tmo_add(uint16_t, struct in_addr *, uint8_t, uint32_t, time_t);
+struct tmo *tmo_first(void);
+uint32_t tmo_ttl(void);
+void tmo_pop(void);
+void tmo_requeue(time_t);
+int tmo_scan(struct tmo_scan *, uint32_t,
+    void (*)(struct tmo *, uint32_t, void *), void *);
+void tmo_stats(struct tmo_stats *);
 
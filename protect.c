@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Protected prefixes, which clients may never add. The prefixes are
+ * merged into sorted, disjoint address ranges and compiled into a
+ * three level DIR-16-8-8 table for single addresses: a level 1 entry
+ * per /16, a block of 256 level 2 entries, one per /24, where a /16 is
+ * only partly protected and a 256 bit bitmap where a /24 is only partly
+ * protected. An entry is 0 for unprotected, 1 for protected or
+ * 2 + the index of the next level block. A single address costs at most
+ * three dependent loads. Prefixes are checked against the ranges with a
+ * binary search, as they overlap a range if they contain or are
+ * contained in it.
+ */
+
+#include "pftabled.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define L1_SIZE		65536
+#define L2_SIZE		256
+#define L3_WORDS	8
+
+struct range {
+	uint32_t	start;		/* host byte order */
+	uint32_t	end;
+};
+
+struct protect {
+	uint32_t	*l1;
+	uint32_t	*l2;
+	uint32_t	 nl2;
+	uint32_t	 l2size;
+	uint32_t	*l3;
+	uint32_t	 nl3;
+	uint32_t	 l3size;
+	struct range	*ranges;
+	int		 nranges;
+};
+
+static int
+range_cmp(const void *a, const void *b)
+{
+	const struct range *x = a, *y = b;
+
+	if (x->start != y->start)
+		return (x->start < y->start ? -1 : 1);
+	return (x->end < y->end ? -1 : x->end > y->end);
+}
+
+/* Grow array *a of *size blocks of n words to hold one more block */
+static int
+grow(uint32_t **a, uint32_t *size, uint32_t used, size_t n)
+{
+	uint32_t *p, s;
+
+	if (used < *size)
+		return (0);
+	s = *size ? *size * 2 : 64;
+	if ((p = realloc(*a, s * n * sizeof(**a))) == NULL)
+		return (-1);
+	*a = p;
+	*size = s;
+
+	return (0);
+}
+
+/* Return the level 2 index for address a, creating the block */
+static int64_t
+level2(struct protect *p, uint32_t a)
+{
+	uint32_t *e = &p->l1[a >> 16];
+
+	if (*e == 0) {
+		if (grow(&p->l2, &p->l2size, p->nl2, L2_SIZE) == -1)
+			return (-1);
+		memset(&p->l2[p->nl2 * L2_SIZE], 0, L2_SIZE * sizeof(*p->l2));
+		*e = 2 + p->nl2++;
+	}
+
+	return ((int64_t)(*e - 2) * L2_SIZE + ((a >> 8) & 0xff));
+}
+
+/* Return the level 3 bitmap index for address a, creating the bitmap */
+static int64_t
+level3(struct protect *p, uint32_t a)
+{
+	int64_t i;
+
+	if ((i = level2(p, a)) == -1)
+		return (-1);
+
+	if (p->l2[i] == 0) {
+		if (grow(&p->l3, &p->l3size, p->nl3, L3_WORDS) == -1)
+			return (-1);
+		memset(&p->l3[p->nl3 * L3_WORDS], 0,
+		    L3_WORDS * sizeof(*p->l3));
+		p->l2[i] = 2 + p->nl3++;
+	}
+
+	return ((int64_t)(p->l2[i] - 2) * L3_WORDS);
+}
+
+/* Mark the addresses from s to e protected, using the largest blocks */
+static int
+mark(struct protect *p, uint32_t s, uint32_t e)
+{
+	uint64_t a = s;
+	int64_t i;
+
+	while (a <= e) {
+		if ((a & 0xffff) == 0 && a + 0xffff <= e) {
+			p->l1[a >> 16] = 1;
+			a += 0x10000;
+		} else if ((a & 0xff) == 0 && a + 0xff <= e) {
+			if ((i = level2(p, a)) == -1)
+				return (-1);
+			p->l2[i] = 1;
+			a += 0x100;
+		} else {
+			if ((i = level3(p, a)) == -1)
+				return (-1);
+			p->l3[i + ((a & 0xff) >> 5)] |= 1U << (a & 31);
+			a++;
+		}
+	}
+
+	return (0);
+}
+
+/* Compile n prefixes. Returns NULL if out of memory. */
+struct protect *
+protect_build(struct prefix *pfx, int n)
+{
+	struct protect *p;
+	uint32_t start, hostmask;
+	int i, j;
+
+	if ((p = calloc(1, sizeof(*p))) == NULL)
+		return (NULL);
+	if ((p->l1 = calloc(L1_SIZE, sizeof(*p->l1))) == NULL ||
+	    (p->ranges = calloc(n + 1, sizeof(*p->ranges))) == NULL)
+		goto fail;
+
+	for (i = 0; i < n; i++) {
+		hostmask = pfx[i].mask >= 32 ? 0 : 0xffffffffU >> pfx[i].mask;
+		start = ntohl(pfx[i].addr.s_addr) & ~hostmask;
+		p->ranges[i].start = start;
+		p->ranges[i].end = start | hostmask;
+	}
+	qsort(p->ranges, n, sizeof(*p->ranges), range_cmp);
+
+	/* Merge overlapping and adjacent ranges */
+	for (i = 0, j = -1; i < n; i++) {
+		if (j >= 0 && (p->ranges[j].end == 0xffffffffU ||
+		    p->ranges[i].start <= p->ranges[j].end + 1)) {
+			if (p->ranges[i].end > p->ranges[j].end)
+				p->ranges[j].end = p->ranges[i].end;
+		} else
+			p->ranges[++j] = p->ranges[i];
+	}
+	p->nranges = j + 1;
+
+	for (i = 0; i < p->nranges; i++)
+		if (mark(p, p->ranges[i].start, p->ranges[i].end) == -1)
+			goto fail;
+
+	return (p);
+
+fail:
+	protect_free(p);
+	return (NULL);
+}
+
+void
+protect_free(struct protect *p)
+{
+	if (p == NULL)
+		return;
+	free(p->l1);
+	free(p->l2);
+	free(p->l3);
+	free(p->ranges);
+	free(p);
+}
+
+/*
+ * Returns 1 if the prefix ip/mask, with host bits cleared, overlaps a
+ * protected prefix.
+ */
+int
+protect_match(struct protect *p, struct in_addr *ip, uint8_t mask)
+{
+	uint32_t a = ntohl(ip->s_addr), v, end;
+	int lo, hi, mid;
+
+	if (mask >= 32) {
+		if ((v = p->l1[a >> 16]) < 2)
+			return (v);
+		if ((v = p->l2[(v - 2) * L2_SIZE + ((a >> 8) & 0xff)]) < 2)
+			return (v);
+		return ((p->l3[(v - 2) * L3_WORDS + ((a & 0xff) >> 5)] >>
+		    (a & 31)) & 1);
+	}
+
+	/* Find the last range starting at or before the end of the prefix */
+	end = a | 0xffffffffU >> mask;
+	lo = 0;
+	hi = p->nranges;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (p->ranges[mid].start <= end)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo > 0 && p->ranges[lo - 1].end >= a);
+}
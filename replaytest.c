@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * Write the capture file make check replays: an acknowledged batch of
+ * two adds received twice, as after a lost acknowledgement, and an
+ * unacknowledged batch of two adds received twice. pftabled-replay has
+ * to apply the first once and the second twice, 6 adds in all.
+ */
+
+#include "pftabled.h"
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define T0	1000000000	/* receive time of the first record */
+
+int
+main(int argc, char *argv[])
+{
+	struct pftabled_batch b;
+	struct sockaddr_in from;
+	struct timespec ts;
+	FILE *f;
+	int i;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: replaytest file\n");
+		return (1);
+	}
+
+	unlink(argv[1]);
+	if ((f = capture_open(argv[1])) == NULL)
+		err(1, "%s", argv[1]);
+
+	memset(&from, 0, sizeof(from));
+	from.sin_family = AF_INET;
+	from.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	from.sin_port = htons(40000);
+
+	memset(&b, 0, sizeof(b));
+	b.version = PFTABLED_BATCH_VERSION;
+	b.mac = MAC_HMAC_SHA1;
+	b.count = htons(2);
+	b.timestamp = htonl(T0);
+	strncpy(b.table, "test", sizeof(b.table) - 1);
+	for (i = 0; i < 2; i++) {
+		b.entries[i].cmd = PFTABLED_CMD_ADD;
+		b.entries[i].mask = 32;
+		b.entries[i].addr.s_addr = htonl(0x0a000001 + i);
+	}
+
+	for (i = 0; i < 4; i++) {
+		b.session = htons(i < 2 ? 7 : 0);
+		b.seq = htons(i < 2 ? 1 : 0);
+		ts.tv_sec = T0 + i;
+		ts.tv_nsec = 0;
+		if (capture_write(f, &ts, &from, &b,
+		    PFTABLED_BATCH_LEN(2)) == -1)
+			err(1, "%s", argv[1]);
+	}
+
+	if (fclose(f) == EOF)
+		err(1, "%s", argv[1]);
+
+	return (0);
+}
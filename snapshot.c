@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Snapshot file (-s). A memory mapped file holding a struct snap_hdr
+ * and two buffers. Snapshot number seq is written to buffer seq & 1, so
+ * the daemon never writes to the buffer holding the latest snapshot.
+ * Before writing, the daemon sets writing to the number of the snapshot
+ * it is about to write. A reader copies the buffer of snapshot seq and
+ * keeps the copy if writing is then at most seq + 1. Growing the file
+ * moves both buffers and skips a snapshot number to invalidate both.
+ * The file never shrinks, so a reader's mapping stays valid.
+ */
+
+#include "pftabled.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SNAP_BUFOFF	64		/* offset of the first buffer */
+#define SNAP_ROUND	65536		/* buffers grow in these steps */
+#define SNAP_RETRIES	100
+
+struct snap {
+	int		 fd;
+	int		 prot;
+	char		*base;
+	size_t		 size;		/* bytes mapped */
+	uint64_t	 next;		/* number of snapshot being written */
+	uint64_t	 served;	/* requests already answered */
+	void		*copy;		/* snapshot read by a reader */
+	size_t		 copysize;
+};
+
+#define HDR(s) ((struct snap_hdr *)(s)->base)
+
+static int
+snap_map(struct snap *s, size_t size)
+{
+	void *p;
+
+	if (s->base != NULL)
+		munmap(s->base, s->size);
+	s->base = NULL;
+
+	p = mmap(NULL, size, s->prot, MAP_SHARED, s->fd, 0);
+	if (p == MAP_FAILED)
+		return (-1);
+	s->base = p;
+	s->size = size;
+
+	return (0);
+}
+
+/*
+ * Open or create the snapshot file path for writing. An existing
+ * snapshot file is reused and keeps its numbering.
+ */
+struct snap *
+snap_create(const char *path)
+{
+	struct snap_hdr *h;
+	struct snap *s;
+	struct stat st;
+	size_t size;
+	int reuse;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return (NULL);
+	s->prot = PROT_READ | PROT_WRITE;
+
+	if ((s->fd = open(path, O_RDWR | O_CREAT, 0644)) == -1 ||
+	    fstat(s->fd, &st) == -1)
+		goto fail;
+
+	size = st.st_size;
+	reuse = size >= SNAP_BUFOFF;
+	if (!reuse) {
+		size = SNAP_BUFOFF + 2 * SNAP_ROUND;
+		if (ftruncate(s->fd, size) == -1)
+			goto fail;
+	}
+	if (snap_map(s, size) == -1)
+		goto fail;
+
+	h = HDR(s);
+	if (!reuse || h->magic != SNAP_MAGIC || h->version != SNAP_VERSION ||
+	    SNAP_BUFOFF + 2 * h->bufsize > size) {
+		h->seq = 0;
+		h->writing = 0;
+		h->requested = 0;
+		h->bufsize = (size - SNAP_BUFOFF) / 2;
+		h->version = SNAP_VERSION;
+		h->magic = SNAP_MAGIC;
+	}
+	s->served = h->requested;
+
+	return (s);
+
+fail:
+	if (s->fd != -1)
+		close(s->fd);
+	free(s);
+	return (NULL);
+}
+
+/* Returns 1 if a reader asked for a new snapshot since the last call */
+int
+snap_requested(struct snap *s)
+{
+	uint64_t r = __atomic_load_n(&HDR(s)->requested, __ATOMIC_RELAXED);
+
+	if (r == s->served)
+		return (0);
+	s->served = r;
+
+	return (1);
+}
+
+/*
+ * Start a snapshot of size bytes and return the buffer to fill in, or
+ * NULL if the file cannot grow. Must be followed by snap_commit().
+ */
+struct snap_buf *
+snap_begin(struct snap *s, size_t size)
+{
+	struct snap_hdr *h = HDR(s);
+	uint64_t bufsize;
+	size_t total;
+
+	s->next = h->seq + 1;
+
+	if (size > h->bufsize) {
+		s->next++;
+		__atomic_store_n(&h->writing, s->next, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+
+		bufsize = size + size / 4;
+		bufsize = (bufsize + SNAP_ROUND - 1) / SNAP_ROUND * SNAP_ROUND;
+		total = SNAP_BUFOFF + 2 * bufsize;
+		if (ftruncate(s->fd, total) == -1 || snap_map(s, total) == -1)
+			return (NULL);
+		h = HDR(s);
+		h->bufsize = bufsize;
+	} else {
+		__atomic_store_n(&h->writing, s->next, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+
+	return ((struct snap_buf *)(s->base + SNAP_BUFOFF +
+	    (s->next & 1) * h->bufsize));
+}
+
+void
+snap_commit(struct snap *s)
+{
+	__atomic_store_n(&HDR(s)->seq, s->next, __ATOMIC_RELEASE);
+}
+
+/* Open snapshot file path for reading, and requesting if rw is set */
+struct snap *
+snap_attach(const char *path, int rw)
+{
+	struct snap *s;
+	struct stat st;
+
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return (NULL);
+	s->prot = PROT_READ | (rw ? PROT_WRITE : 0);
+
+	if ((s->fd = open(path, rw ? O_RDWR : O_RDONLY)) == -1 ||
+	    fstat(s->fd, &st) == -1)
+		goto fail;
+
+	errno = EINVAL;
+	if (st.st_size < SNAP_BUFOFF ||
+	    snap_map(s, st.st_size) == -1 ||
+	    HDR(s)->magic != SNAP_MAGIC || HDR(s)->version != SNAP_VERSION)
+		goto fail;
+
+	return (s);
+
+fail:
+	if (s->fd != -1)
+		close(s->fd);
+	free(s);
+	return (NULL);
+}
+
+/* Ask the daemon for a new snapshot */
+void
+snap_request(struct snap *s)
+{
+	__atomic_add_fetch(&HDR(s)->requested, 1, __ATOMIC_SEQ_CST);
+}
+
+uint64_t
+snap_seq(struct snap *s)
+{
+	return (__atomic_load_n(&HDR(s)->seq, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Return a consistent copy of the latest snapshot, valid until the next
+ * call. Returns NULL with errno set to EAGAIN if there is none yet or
+ * the daemon kept overwriting it.
+ */
+struct snap_buf *
+snap_read(struct snap *s)
+{
+	struct snap_buf sb;
+	struct stat st;
+	uint64_t seq, bufsize;
+	size_t len;
+	char *src;
+	void *p;
+	int i;
+
+	for (i = 0; i < SNAP_RETRIES; i++) {
+		if (i > 0)
+			usleep(1000);
+
+		if ((seq = snap_seq(s)) == 0)
+			break;
+		bufsize = __atomic_load_n(&HDR(s)->bufsize,
+		    __ATOMIC_RELAXED);
+
+		if (SNAP_BUFOFF + 2 * bufsize > s->size) {
+			if (fstat(s->fd, &st) == -1 ||
+			    snap_map(s, st.st_size) == -1)
+				return (NULL);
+			continue;
+		}
+
+		src = s->base + SNAP_BUFOFF + (seq & 1) * bufsize;
+		memcpy(&sb, src, sizeof(sb));
+		len = sizeof(sb) + sb.ntables * sizeof(struct snap_table) +
+		    sb.nentries * sizeof(struct snap_entry);
+		if (sb.ntables > TABLE_MAX || len > bufsize)
+			continue;
+
+		if (len > s->copysize) {
+			if ((p = realloc(s->copy, len)) == NULL)
+				return (NULL);
+			s->copy = p;
+			s->copysize = len;
+		}
+		memcpy(s->copy, src, len);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&HDR(s)->writing, __ATOMIC_RELAXED) <=
+		    seq + 1)
+			return (s->copy);
+	}
+
+	errno = EAGAIN;
+	return (NULL);
+}
@@ -0,0 +1,237 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Table name registry. Every table name the daemon is willing to touch is
+ * interned once into a small integer id. Lookups of the 32 byte name from
+ * a message go through a perfect hash which is rebuilt whenever a new name
+ * is interned, so the hot path is one hash, one probe and one compare.
+ */
+
+#include "pftabled.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_MAXDISP	0xFFFF
+#define TABLE_NONE	0xFFFF
+
+static char names[TABLE_MAX][PF_TABLE_NAME_SIZE];
+static int nnames = 0;
+
+/*
+ * Hash and displace: the upper half of a name's hash selects a bucket,
+ * the lower half mixed with the bucket's displacement selects the slot.
+ * Displacements are chosen at build time so that no two names share a
+ * slot.
+ */
+static uint16_t *disp = NULL;	/* displacement per bucket */
+static uint16_t *slots = NULL;	/* id per slot or TABLE_NONE */
+static uint32_t bucketmask = 0;
+static int slotshift = 32;
+static uint32_t seed = 0;
+
+static uint64_t
+hash(uint32_t s, const char *name)
+{
+	uint64_t h = 14695981039346656037ULL ^ s;
+	int i;
+
+	for (i = 0; i < PF_TABLE_NAME_SIZE && name[i] != '\0'; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 1099511628211ULL;
+	}
+
+	/* FNV leaves the upper bits poorly mixed for short names */
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+
+	return (h);
+}
+
+#define BUCKET(h)	((uint32_t)((h) >> 32) & bucketmask)
+#define SLOT(h, d)	(((uint32_t)(h) ^ (d)) * 0x9E3779B1U >> slotshift)
+
+static int
+bucket_cmp(const void *a, const void *b)
+{
+	return (*(const uint64_t *)b > *(const uint64_t *)a ? 1 :
+	    *(const uint64_t *)b < *(const uint64_t *)a ? -1 : 0);
+}
+
+/*
+ * Place the n names listed in member using displacement d. Returns 0 on
+ * success or -1 after undoing a partial placement.
+ */
+static int
+place(uint16_t *s, const uint64_t *h, const uint16_t *member, int n,
+    uint32_t d)
+{
+	uint32_t slot;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		slot = SLOT(h[member[i]], d);
+		if (s[slot] != TABLE_NONE) {
+			while (i-- > 0)
+				s[SLOT(h[member[i]], d)] = TABLE_NONE;
+			return (-1);
+		}
+		s[slot] = member[i];
+	}
+
+	return (0);
+}
+
+static int
+rebuild(void)
+{
+	uint64_t h[TABLE_MAX], order[TABLE_MAX];
+	uint16_t member[TABLE_MAX], start[TABLE_MAX + 1];
+	uint16_t *s = NULL, *dp = NULL;
+	uint32_t nbuckets, nslots, b, d, try;
+	int i, n, bits;
+
+	for (nbuckets = 1; nbuckets < (uint32_t)nnames / 2; nbuckets <<= 1)
+		;
+	for (bits = 3; (1U << bits) < 2 * (uint32_t)nnames; bits++)
+		;
+	nslots = 1U << bits;
+
+	if ((s = malloc(nslots * sizeof(*s))) == NULL ||
+	    (dp = calloc(nbuckets, sizeof(*dp))) == NULL) {
+		free(s);
+		return (-1);
+	}
+
+	bucketmask = nbuckets - 1;
+	slotshift = 32 - bits;
+
+	for (try = 1; ; try++) {
+		memset(s, 0xFF, nslots * sizeof(*s));
+		memset(start, 0, sizeof(start));
+		for (i = 0; i < nnames; i++) {
+			h[i] = hash(try, names[i]);
+			start[BUCKET(h[i]) + 1]++;
+		}
+
+		/* Group names by bucket, then place the fullest first */
+		for (b = 0; b < nbuckets; b++) {
+			order[b] = (uint64_t)start[b + 1] << 32 | b;
+			start[b + 1] += start[b];
+		}
+		for (i = nnames - 1; i >= 0; i--)
+			member[--start[BUCKET(h[i]) + 1]] = i;
+		qsort(order, nbuckets, sizeof(order[0]), bucket_cmp);
+
+		for (b = 0; b < nbuckets; b++) {
+			if ((n = order[b] >> 32) == 0)
+				break;
+			i = start[(uint32_t)order[b] + 1];
+			for (d = 0; d <= HASH_MAXDISP; d++)
+				if (place(s, h, member + i, n, d) == 0)
+					break;
+			if (d > HASH_MAXDISP)
+				break;
+			dp[(uint32_t)order[b]] = d;
+		}
+		if (b == nbuckets || (order[b] >> 32) == 0)
+			break;
+	}
+
+	free(slots);
+	free(disp);
+	slots = s;
+	disp = dp;
+	seed = try;
+
+	return (0);
+}
+
+/*
+ * Return the id of table name, which may not be NUL terminated if it
+ * fills all PF_TABLE_NAME_SIZE bytes, or -1 if it is not interned.
+ */
+int
+table_lookup(const char *name)
+{
+	uint64_t h;
+	uint16_t id;
+
+	if (slots == NULL)
+		return (-1);
+
+	h = hash(seed, name);
+	id = slots[SLOT(h, disp[BUCKET(h)])];
+	if (id == TABLE_NONE ||
+	    strncmp(names[id], name, PF_TABLE_NAME_SIZE) != 0)
+		return (-1);
+
+	return (id);
+}
+
+/*
+ * Intern table name and return its id. Returns -1 if the name is not a
+ * valid pf table name or the registry is full.
+ */
+int
+table_intern(const char *name)
+{
+	size_t len;
+	int id;
+
+	if ((id = table_lookup(name)) != -1)
+		return (id);
+
+	for (len = 0; len < PF_TABLE_NAME_SIZE && name[len] != '\0'; len++)
+		;
+	if (len == 0 || len == PF_TABLE_NAME_SIZE || nnames == TABLE_MAX)
+		return (-1);
+
+	id = nnames++;
+	memset(names[id], 0, PF_TABLE_NAME_SIZE);
+	memcpy(names[id], name, len);
+
+	if (rebuild() == -1) {
+		nnames--;
+		return (-1);
+	}
+
+	return (id);
+}
+
+const char *
+table_name(int id)
+{
+	return (names[id]);
+}
+
+int
+table_count(void)
+{
+	return (nnames);
+}
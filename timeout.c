@@ -0,0 +1,408 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Timeout queue. Entries are 16 byte records carved from large chunks
+ * and linked by index instead of pointer. Freed entries go to a free
+ * list and are reused before a new chunk is allocated, so mass expiry
+ * does not leave the heap fragmented. All chunks are released once the
+ * queue runs empty.
+ *
+ * Entries are queued in one lane per distinct lifetime. As an entry
+ * expires at the time it was added plus its lifetime, every lane is in
+ * order of expiry by itself and adding is O(1). The lanes with entries
+ * are kept in a binary heap ordered by their first entry, so finding
+ * and removing the next entry to expire costs O(log lanes). There are
+ * usually only a few lanes, one per table default and per lifetime
+ * clients ask for.
+ */
+
+#include "pftabled.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TMO_CHUNKBITS	16
+#define TMO_CHUNKSIZE	(1U << TMO_CHUNKBITS)
+#define TMO_CHUNKMAX	(TMO_NIL >> TMO_CHUNKBITS)
+#define LANE_HASH	1024
+
+struct lane {
+	uint32_t	ttl;
+	uint32_t	head;		/* expires first */
+	uint32_t	tail;
+	uint32_t	hnext;		/* next in hash chain or free list */
+	uint32_t	pos;		/* index in heap */
+	uint64_t	pushed;		/* entries ever appended */
+	uint64_t	popped;		/* entries ever removed */
+};
+
+static struct tmo **chunks = NULL;
+static uint32_t nchunks = 0;	/* chunks allocated */
+static uint32_t maxchunks = 0;	/* size of chunks array */
+static uint32_t fresh = 0;	/* first never used index */
+static uint32_t freelist = TMO_NIL;
+static uint32_t used = 0;
+
+static struct lane *lanes = NULL;
+static uint32_t nlanes = 0;	/* lanes allocated */
+static uint32_t maxlanes = 0;
+static uint32_t freelanes = TMO_NIL;
+static uint32_t hash[LANE_HASH];
+static int hashinit = 0;
+
+static uint32_t *heap = NULL;	/* lanes with entries */
+static uint32_t nheap = 0;
+
+#define ENTRY(i) (&chunks[(i) >> TMO_CHUNKBITS][(i) & (TMO_CHUNKSIZE - 1)])
+#define FIRST(l) (ENTRY(lanes[l].head)->expire)
+
+static uint32_t
+tmo_alloc(void)
+{
+	struct tmo **c;
+	uint32_t i, n;
+
+	if (freelist != TMO_NIL) {
+		i = freelist;
+		freelist = ENTRY(i)->next;
+		return (i);
+	}
+
+	if (fresh == nchunks << TMO_CHUNKBITS) {
+		if (nchunks == TMO_CHUNKMAX)
+			return (TMO_NIL);
+		if (nchunks == maxchunks) {
+			n = maxchunks ? maxchunks * 2 : 16;
+			if ((c = realloc(chunks, n * sizeof(*c))) == NULL)
+				return (TMO_NIL);
+			chunks = c;
+			maxchunks = n;
+		}
+		if ((chunks[nchunks] = malloc(TMO_CHUNKSIZE *
+		    sizeof(struct tmo))) == NULL)
+			return (TMO_NIL);
+		nchunks++;
+	}
+
+	return (fresh++);
+}
+
+static void
+tmo_release(void)
+{
+	while (nchunks > 0)
+		free(chunks[--nchunks]);
+	free(chunks);
+	chunks = NULL;
+	maxchunks = 0;
+	fresh = 0;
+	freelist = TMO_NIL;
+}
+
+static void
+heap_set(uint32_t pos, uint32_t l)
+{
+	heap[pos] = l;
+	lanes[l].pos = pos;
+}
+
+static void
+heap_up(uint32_t pos)
+{
+	uint32_t l = heap[pos], parent;
+
+	while (pos > 0) {
+		parent = (pos - 1) / 2;
+		if (FIRST(heap[parent]) <= FIRST(l))
+			break;
+		heap_set(pos, heap[parent]);
+		pos = parent;
+	}
+	heap_set(pos, l);
+}
+
+static void
+heap_down(uint32_t pos)
+{
+	uint32_t l = heap[pos], child;
+
+	while ((child = 2 * pos + 1) < nheap) {
+		if (child + 1 < nheap &&
+		    FIRST(heap[child + 1]) < FIRST(heap[child]))
+			child++;
+		if (FIRST(l) <= FIRST(heap[child]))
+			break;
+		heap_set(pos, heap[child]);
+		pos = child;
+	}
+	heap_set(pos, l);
+}
+
+/* Return the lane for lifetime ttl, creating it. TMO_NIL if no memory. */
+static uint32_t
+lane_get(uint32_t ttl)
+{
+	struct lane *p;
+	uint32_t *q, l, n;
+
+	if (!hashinit) {
+		memset(hash, 0xff, sizeof(hash));
+		hashinit = 1;
+	}
+
+	for (l = hash[ttl % LANE_HASH]; l != TMO_NIL; l = lanes[l].hnext)
+		if (lanes[l].ttl == ttl)
+			return (l);
+
+	if (freelanes != TMO_NIL) {
+		l = freelanes;
+		freelanes = lanes[l].hnext;
+	} else {
+		if (nlanes == maxlanes) {
+			n = maxlanes ? maxlanes * 2 : 16;
+			if ((p = realloc(lanes, n * sizeof(*p))) == NULL)
+				return (TMO_NIL);
+			lanes = p;
+			if ((q = realloc(heap, n * sizeof(*q))) == NULL)
+				return (TMO_NIL);
+			heap = q;
+			maxlanes = n;
+		}
+		/* A reused lane keeps its counters, see tmo_scan() */
+		l = nlanes++;
+		lanes[l].pushed = lanes[l].popped = 0;
+	}
+
+	lanes[l].ttl = ttl;
+	lanes[l].head = lanes[l].tail = TMO_NIL;
+	lanes[l].pos = TMO_NIL;
+	lanes[l].hnext = hash[ttl % LANE_HASH];
+	hash[ttl % LANE_HASH] = l;
+
+	return (l);
+}
+
+static void
+lane_free(uint32_t l)
+{
+	uint32_t *p;
+
+	for (p = &hash[lanes[l].ttl % LANE_HASH]; *p != l;
+	    p = &lanes[*p].hnext)
+		;
+	*p = lanes[l].hnext;
+	lanes[l].hnext = freelanes;
+	freelanes = l;
+}
+
+/* Append entry i to lane l, expiring ttl seconds after now */
+static void
+lane_push(uint32_t l, uint32_t i, time_t now)
+{
+	struct lane *ln = &lanes[l];
+	struct tmo *t = ENTRY(i);
+	uint64_t expire = (uint64_t)now + ln->ttl;
+
+	if (expire > 0xffffffffU)
+		expire = 0xffffffffU;
+	/* Keep the lane in order if the clock went back */
+	if (ln->tail != TMO_NIL && expire < ENTRY(ln->tail)->expire)
+		expire = ENTRY(ln->tail)->expire;
+
+	t->next = TMO_NIL;
+	t->expire = (uint32_t)expire;
+
+	if (ln->tail == TMO_NIL) {
+		ln->head = i;
+		heap_set(nheap++, l);
+		heap_up(nheap - 1);
+	} else
+		ENTRY(ln->tail)->next = i;
+	ln->tail = i;
+	ln->pushed++;
+}
+
+/*
+ * Queue a new entry expiring ttl seconds, which must not be 0, after
+ * now. Returns -1 if no memory is left.
+ */
+int
+tmo_add(uint16_t table, struct in_addr *ip, uint8_t mask, uint32_t ttl,
+    time_t now)
+{
+	struct tmo *t;
+	uint32_t i, l;
+
+	if ((l = lane_get(ttl)) == TMO_NIL)
+		return (-1);
+	if ((i = tmo_alloc()) == TMO_NIL) {
+		if (lanes[l].head == TMO_NIL)
+			lane_free(l);
+		return (-1);
+	}
+
+	t = ENTRY(i);
+	t->ip = *ip;
+	t->table = table;
+	t->mask = mask;
+	t->spare = 0;
+	lane_push(l, i, now);
+	used++;
+
+	return (0);
+}
+
+/* Return the entry expiring next or NULL if the queue is empty. */
+struct tmo *
+tmo_first(void)
+{
+	return (nheap == 0 ? NULL : ENTRY(lanes[heap[0]].head));
+}
+
+/* Return the lifetime of the entry returned by tmo_first(). */
+uint32_t
+tmo_ttl(void)
+{
+	return (nheap == 0 ? 0 : lanes[heap[0]].ttl);
+}
+
+/* Unlink the first entry of the first lane and return its index */
+static uint32_t
+tmo_unlink(void)
+{
+	uint32_t l = heap[0], i = lanes[l].head;
+
+	lanes[l].popped++;
+	if ((lanes[l].head = ENTRY(i)->next) == TMO_NIL) {
+		lanes[l].tail = TMO_NIL;
+		if (--nheap > 0) {
+			heap_set(0, heap[nheap]);
+			heap_down(0);
+		}
+		lane_free(l);
+	} else
+		heap_down(0);
+
+	return (i);
+}
+
+/* Remove the entry returned by tmo_first(). */
+void
+tmo_pop(void)
+{
+	uint32_t i;
+
+	if (nheap == 0)
+		return;
+
+	i = tmo_unlink();
+	ENTRY(i)->next = freelist;
+	freelist = i;
+
+	if (--used == 0)
+		tmo_release();
+}
+
+/*
+ * Queue the entry returned by tmo_first() again, expiring its lifetime
+ * after now.
+ */
+void
+tmo_requeue(time_t now)
+{
+	uint32_t ttl, i;
+
+	if (nheap == 0)
+		return;
+
+	/* A lane freed by unlinking its last entry is reused right away */
+	ttl = lanes[heap[0]].ttl;
+	i = tmo_unlink();
+	lane_push(lane_get(ttl), i, now);
+}
+
+/*
+ * Call fn for up to max more entries with their lifetime, continuing
+ * the scan *sc, which starts zeroed. Entries are visited lane by lane,
+ * each lane in order of expiry, so the queue may change between calls:
+ * entries removed meanwhile are skipped and entries added to a lane
+ * after the scan reached it are not visited. Returns 1 once every lane
+ * was scanned.
+ */
+int
+tmo_scan(struct tmo_scan *sc, uint32_t max,
+    void (*fn)(struct tmo *, uint32_t, void *), void *arg)
+{
+	struct lane *ln;
+	uint32_t n = 0;
+
+	while (n < max) {
+		if (sc->lane >= nlanes)
+			return (1);
+		ln = &lanes[sc->lane];
+
+		if (sc->end == 0) {
+			/* Reaching the lane: visit what it holds now */
+			if (ln->head == TMO_NIL) {
+				sc->lane++;
+				continue;
+			}
+			sc->entry = ln->head;
+			sc->seq = ln->popped;
+			sc->end = ln->pushed;
+		} else if (sc->seq < ln->popped) {
+			/* The entry was removed, and maybe the lane freed */
+			sc->entry = ln->head;
+			sc->seq = ln->popped;
+		}
+
+		if (sc->seq >= sc->end) {
+			sc->lane++;
+			sc->end = 0;
+			continue;
+		}
+
+		fn(ENTRY(sc->entry), ln->ttl, arg);
+		sc->entry = ENTRY(sc->entry)->next;
+		sc->seq++;
+		n++;
+	}
+
+	return (0);
+}
+
+void
+tmo_stats(struct tmo_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->entries = used;
+	st->lanes = nheap;
+	st->capacity = (uint64_t)nchunks << TMO_CHUNKBITS;
+	st->bytes = st->capacity * sizeof(struct tmo) +
+	    maxchunks * sizeof(struct tmo *) +
+	    maxlanes * (sizeof(struct lane) + sizeof(*heap));
+}
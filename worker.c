@@ -0,0 +1,380 @@
+/*
+ * Copyright (c) 2026 Armin Wolfermann. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Receive workers (-j). Each worker thread receives datagrams and runs
+ * the check and auth stages of msg.c. The commands of accepted datagrams
+ * are handed to the single thread owning the tables through a lock-free single
+ * producer, single consumer ring per worker. The owner sleeps on a pipe
+ * which a worker only writes to when the owner announced it is about to
+ * sleep.
+ *
+ * Workers read the configuration through workers_conf(). A replaced
+ * configuration is freed once every worker has started a new iteration
+ * after the replacement, see workers_setconf().
+ */
+
+#include "pftabled.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define SCLOAD(p)	__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define SCSTORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+struct ring {
+	uint32_t	head;		/* next item to pop, owner only */
+	char		pad1[CACHELINE - 4];
+	uint32_t	tail;		/* next free item, worker only */
+	char		pad2[CACHELINE - 4];
+	struct item	items[RING_SIZE];
+};
+
+struct retired {
+	struct conf	*conf;
+	uint64_t	 epoch;
+	struct retired	*next;
+};
+
+static struct worker *workers = NULL;
+static int nworkers = 0;
+static int flags = 0;
+static int next = 0;		/* ring to pop from first */
+
+static int wakefd[2] = { -1, -1 };
+static int sleeping = 0;
+
+static struct conf *wconf = NULL;
+static uint64_t epoch = 1;
+static struct retired *retired = NULL;
+
+static int (*source)(struct worker *, union pftabled_pkt *,
+    struct sockaddr_in *, time_t *);
+static void (*reject)(int, struct item *);
+
+/* Monotonic nanoseconds with WORKER_TIME, else 0 */
+static uint64_t
+wclock(void)
+{
+	struct timespec ts;
+
+	if (!(flags & WORKER_TIME))
+		return (0);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static int
+ring_push(struct ring *r, struct item *it)
+{
+	uint32_t tail = r->tail;
+
+	if (tail - LOAD(&r->head) == RING_SIZE)
+		return (-1);
+
+	r->items[tail & (RING_SIZE - 1)] = *it;
+	SCSTORE(&r->tail, tail + 1);
+
+	return (0);
+}
+
+static int
+ring_pop(struct ring *r, struct item *it)
+{
+	uint32_t head = r->head;
+
+	if (head == SCLOAD(&r->tail))
+		return (-1);
+
+	*it = r->items[head & (RING_SIZE - 1)];
+	STORE(&r->head, head + 1);
+
+	return (0);
+}
+
+/* Load first: the exchange would take the cache line on every push */
+static void
+wakeup(void)
+{
+	if (SCLOAD(&sleeping) &&
+	    __atomic_exchange_n(&sleeping, 0, __ATOMIC_SEQ_CST))
+		(void)write(wakefd[1], "", 1);
+}
+
+static void *
+worker_main(void *arg)
+{
+	struct worker *w = arg;
+	union pftabled_pkt pkt;
+	struct item it;
+	struct conf *c;
+	uint64_t t0, t1;
+	int i, n, r;
+
+	for (;;) {
+		n = source(w, &pkt, &it.from, &it.received);
+		if (n == WORKER_DONE)
+			break;
+		c = workers_conf(w);
+
+		t0 = wclock();
+		r = msg_check(&pkt, n, it.received);
+		t1 = wclock();
+		w->checkns += t1 - t0;
+		w->checks++;
+		if (r == MSG_OK) {
+			r = msg_auth(c, &pkt, n);
+			w->authns += wclock() - t1;
+			w->auths++;
+		}
+		if (r != MSG_OK) {
+			if (r != MSG_SHORT && reject != NULL)
+				reject(r, &it);
+			continue;
+		}
+
+		msg_ackreq(&pkt, &it.ack);
+		for (i = 0, n = msg_count(&pkt); i < n; i++) {
+			msg_entry(&pkt, i, &it.msg, &it.ttl);
+			it.ack.last = i == n - 1;
+			__atomic_add_fetch(&w->received, 1, __ATOMIC_RELAXED);
+			while ((r = ring_push(w->ring, &it)) == -1 &&
+			    (flags & WORKER_WAIT)) {
+				wakeup();
+				sched_yield();
+			}
+			if (r == 0) {
+				wakeup();
+				continue;
+			}
+			__atomic_add_fetch(&w->dropped, 1, __ATOMIC_RELAXED);
+			/* Drop the rest, the client sends the batch again */
+			if (it.ack.session) {
+				__atomic_add_fetch(&w->received, n - i - 1,
+				    __ATOMIC_RELAXED);
+				__atomic_add_fetch(&w->dropped, n - i - 1,
+				    __ATOMIC_RELAXED);
+				break;
+			}
+		}
+	}
+
+	STORE(&w->done, 1);
+	wakeup();
+
+	return (NULL);
+}
+
+/*
+ * Allocate n workers, to be set up by the caller before workers_start().
+ * f is 0 or a combination of WORKER_WAIT and WORKER_TIME.
+ */
+struct worker *
+workers_init(int n, int f)
+{
+	void *p;
+	int i;
+
+	/* Cache line aligned, as workers update their counters a lot */
+	if (posix_memalign(&p, CACHELINE, n * sizeof(*workers)) != 0)
+		return (NULL);
+	workers = p;
+	memset(workers, 0, n * sizeof(*workers));
+
+	for (i = 0; i < n; i++) {
+		workers[i].id = i;
+		workers[i].sock = -1;
+		if (posix_memalign(&p, CACHELINE, sizeof(struct ring)) != 0)
+			return (NULL);
+		memset(p, 0, sizeof(struct ring));
+		workers[i].ring = p;
+	}
+
+	if (pipe(wakefd) == -1 ||
+	    fcntl(wakefd[0], F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(wakefd[1], F_SETFL, O_NONBLOCK) == -1)
+		return (NULL);
+
+	nworkers = n;
+	flags = f;
+
+	return (workers);
+}
+
+/*
+ * Start all workers. src fills in the next datagram, its sender and the
+ * current time and returns its length, -1 if there is none or
+ * WORKER_DONE to stop the worker. rej, which may be NULL, is called for
+ * every rejected datagram.
+ * Signals are blocked in the workers so they interrupt the owner.
+ */
+int
+workers_start(struct conf *c,
+    int (*src)(struct worker *, union pftabled_pkt *, struct sockaddr_in *,
+    time_t *), void (*rej)(int, struct item *))
+{
+	sigset_t all, old;
+	int i, error = 0;
+
+	source = src;
+	reject = rej;
+	wconf = c;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < nworkers && !error; i++)
+		error = pthread_create(&workers[i].thread, NULL,
+		    worker_main, &workers[i]);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (error) {
+		errno = error;
+		return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Pop the next accepted message from any worker, waiting up to timeout
+ * milliseconds. Returns 0 if there is none.
+ */
+int
+workers_pop(struct item *it, int timeout)
+{
+	struct pollfd pfd;
+	struct ring *r;
+	char buf[64];
+	int i, pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < nworkers; i++) {
+			r = workers[next].ring;
+			next = (next + 1) % nworkers;
+			if (ring_pop(r, it) == 0) {
+				if (pass)
+					SCSTORE(&sleeping, 0);
+				return (1);
+			}
+		}
+
+		/* Announce sleep, then look again to not miss a wakeup */
+		if (pass == 0)
+			SCSTORE(&sleeping, 1);
+	}
+
+	pfd.fd = wakefd[0];
+	pfd.events = POLLIN;
+	poll(&pfd, 1, timeout);
+	while (read(wakefd[0], buf, sizeof(buf)) > 0)
+		;
+	SCSTORE(&sleeping, 0);
+
+	return (0);
+}
+
+/* Returns 1 once all workers stopped and all rings are empty */
+int
+workers_done(void)
+{
+	int i;
+
+	for (i = 0; i < nworkers; i++)
+		if (!LOAD(&workers[i].done) ||
+		    workers[i].ring->head != SCLOAD(&workers[i].ring->tail))
+			return (0);
+
+	return (1);
+}
+
+/* Called by a worker at the start of every message */
+struct conf *
+workers_conf(struct worker *w)
+{
+	__atomic_store_n(&w->epoch, SCLOAD(&epoch), __ATOMIC_SEQ_CST);
+	return (SCLOAD(&wconf));
+}
+
+/* Free replaced configurations no worker can be using anymore */
+void
+workers_reclaim(void)
+{
+	struct retired **rp, *r;
+	uint64_t min = (uint64_t)-1, e;
+	int i;
+
+	for (i = 0; i < nworkers; i++) {
+		if (LOAD(&workers[i].done))
+			continue;
+		if ((e = SCLOAD(&workers[i].epoch)) < min)
+			min = e;
+	}
+
+	for (rp = &retired; (r = *rp) != NULL; ) {
+		if (r->epoch <= min) {
+			*rp = r->next;
+			conf_destroy(r->conf);
+			free(r);
+		} else
+			rp = &r->next;
+	}
+}
+
+/*
+ * Switch workers to configuration c and retire old, which is freed by a
+ * later workers_reclaim(). Without workers old is freed right away.
+ */
+void
+workers_setconf(struct conf *c, struct conf *old)
+{
+	struct retired *r;
+
+	if (nworkers == 0) {
+		conf_destroy(old);
+		return;
+	}
+
+	SCSTORE(&wconf, c);
+	__atomic_add_fetch(&epoch, 1, __ATOMIC_SEQ_CST);
+
+	/* Rather leak than free under a worker */
+	if ((r = malloc(sizeof(*r))) == NULL)
+		return;
+	r->conf = old;
+	r->epoch = SCLOAD(&epoch);
+	r->next = retired;
+	retired = r;
+}